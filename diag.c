@@ -183,6 +183,11 @@ void uosResourceDiag()
 #endif
 
 #endif
+
+#if UOSCFG_SPI_BUS > 0 && UOSCFG_SPI_STATS > 0
+  uosSpiDiag();
+#endif
+
 #endif
 }
 
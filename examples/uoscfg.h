@@ -44,6 +44,11 @@
  */
 #define _FS_READONLY 1
 
+/**
+ * Include uosFormatFat and f_mkfs. Requires _FS_READONLY 0.
+ */
+#define _USE_MKFS 0
+
 /**
  * Select version of uosSpinUSecs to be included:
  * - 0: Don't include uosSpinUSecs,
@@ -67,12 +72,106 @@
  */
 #define UOSCFG_FAT 10
 
+/**
+ * Free cluster chains of removed or truncated FAT files in a
+ * background task instead of the calling task. Value is the number of
+ * chains that can wait for reclaim, if queue is full chain is freed
+ * immediately. Clusters are not reusable until reclaimed.
+ */
+#define UOSCFG_FAT_RECLAIM 0
+
+/**
+ * Priority of FAT cluster reclaim task.
+ */
+#define UOSCFG_FAT_RECLAIM_PRIO 1
+
+/**
+ * Number of clusters to leave between files that are written
+ * concurrently to FAT filesystem, so that each file stays
+ * contiguous. 0 uses default FatFs allocation.
+ */
+#define UOSCFG_FAT_ALLOC_GAP 0
+
+/**
+ * Write back data of open FAT files in a background task when it has
+ * been dirty for half of this many milliseconds. Files that are
+ * being written continuously are written back after this many
+ * milliseconds. 0 disables flusher task.
+ */
+#define UOSCFG_FAT_FLUSH_MS 0
+
+/**
+ * Wake up FAT flusher task early when this many sectors
+ * have been written after previous writeback.
+ */
+#define UOSCFG_FAT_FLUSH_SECTORS 64
+
+/**
+ * Priority of FAT flusher task.
+ */
+#define UOSCFG_FAT_FLUSH_PRIO 1
+
 /** 
  * Enable MMC layer for FAT filesystem. User application must implement uosMmc_SPI* functions
  * to access actual hardware.
  */
 #define UOSCFG_FAT_MMC 1
 
+/**
+ * Sequential reads and writes to MMC/SD card continue same multiple
+ * block command if next request arrives within this many milliseconds.
+ * Idle multiple block commands are closed by FAT flush task, so nonzero
+ * value requires UOSCFG_FAT_FLUSH_MS. 0 closes multiple block commands
+ * after each request (default if flusher is disabled).
+ * Single sector reads that don't continue previous read use CMD17.
+ */
+#define UOSCFG_FAT_MMC_STREAM_MS 0
+
+/**
+ * Enable CRC checking of MMC/SD card commands and data blocks (CMD59).
+ * Value selects how many bytes CRC16 processes per round (1, 2 or 4),
+ * more bytes need larger tables.
+ */
+#define UOSCFG_FAT_MMC_CRC 0
+
+/**
+ * Max SPI clock rate for MMC/SD card. Actual rate is
+ * taken from TRAN_SPEED of card CSD, limited by this. Can be overridden
+ * per card with maxClock field of UosMmcDisk.
+ */
+#define UOSCFG_FAT_MMC_MAX_HZ 25000000
+
+/**
+ * Switch SD cards to high speed mode (CMD6) if max clock rate
+ * allows running faster than card default speed.
+ */
+#define UOSCFG_FAT_MMC_HIGH_SPEED 0
+
+/**
+ * Size of MMC/SD card write staging buffer in sectors (power of two),
+ * 0 disables staging. Buffer collects contiguous writes that fall into
+ * same aligned part of card erase block and writes them as one pre-erased
+ * (ACMD23) burst when it becomes full. Staged data is written
+ * to card at latest when disk is synced (CTRL_SYNC) or initialized
+ * again, write errors are reported by sync.
+ */
+#define UOSCFG_FAT_MMC_STAGE 0
+
+/**
+ * While MMC/SD card is busy, driver polls it this many times
+ * before starting to sleep between polls. Sleep time doubles
+ * after each poll until it reaches UOSCFG_FAT_MMC_BUSY_SLEEP_MS.
+ * Both can be overridden per card in UosMmcDisk.
+ */
+#define UOSCFG_FAT_MMC_BUSY_SPIN 200
+#define UOSCFG_FAT_MMC_BUSY_SLEEP_MS 8
+
+/**
+ * Number of times MMC/SD card read or write is retried after
+ * failure. Default is 3 if CRC checking is enabled, otherwise 0.
+ */
+/* #define UOSCFG_FAT_MMC_RETRIES 3 */
+
 /** 
  * Enable romFS filesystem and configure number of simultaneously open files.
  */
@@ -94,4 +193,48 @@
  */
 #define UOSCFG_SPI_BUS 1
 
+/**
+ * Smallest transfer that is passed to asynchronous (DMA)
+ * xmitAsync/rcvrAsync hooks or interrupt-driven FIFO
+ * engine of SPI bus. Shorter transfers are done synchronously,
+ * as setup would cost more than it saves.
+ */
+#define UOSCFG_SPI_ASYNC_MIN 32
+
+/**
+ * Enable uosSpiReserve/uosSpiRelease for bursts of SPI bus
+ * cycles by one task. Requires POSCFG_FEATURE_GETTASK.
+ */
+#define UOSCFG_SPI_RESERVE 0
+
+/**
+ * For boards with only one SPI bus: name of header that
+ * provides static inline uosSpiStaticXchg(data),
+ * uosSpiStaticXmit(data, len) and uosSpiStaticRcvr(data, len)
+ * functions. uosSpiXchg, uosSpiXmit and uosSpiRcvr then call
+ * them directly instead of going through bus hooks.
+ */
+/* #define UOSCFG_SPI_STATIC_BUS "spi_board.h" */
+
+/**
+ * Enable prioritized transaction queue for SPI bus (uosSpiSubmit).
+ * Each bus gets a worker task with UOSCFG_SPI_QUEUE_PRIO priority.
+ */
+#define UOSCFG_SPI_QUEUE 0
+#define UOSCFG_SPI_QUEUE_PRIO 4
+
+/**
+ * Collect bus usage statistics for each SPI device
+ * (uosSpiGetStats, uosResourceDiag). Times are measured with
+ * UOSCFG_SPI_STATS_TIME(), which defaults to jiffies. For short
+ * transactions define it as a faster counter, like cycle counter.
+ */
+#define UOSCFG_SPI_STATS 0
+
+/**
+ * Compile simulated SD card on SPI bus. Available
+ * only on unix port.
+ */
+#define UOSCFG_SPI_SDSIM 0
+
 /** @} */
@@ -941,22 +941,47 @@ FRESULT remove_chain (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Remove a cluster chain, possibly deferred              */
+/*-----------------------------------------------------------------------*/
+#if _FS_RECLAIM
+static
+FRESULT defer_chain (
+	FATFS* fs,			/* File system object */
+	DWORD clst			/* Cluster# to remove a chain from */
+)
+{
+	if (clst < 2 || clst >= fs->n_fatent) return FR_INT_ERR;
+	if (ff_defer_chain(fs, clst)) return FR_OK;	/* Queued for f_reclaim() */
+	return remove_chain(fs, clst);				/* Queue full, remove it now */
+}
+#elif !_FS_READONLY
+#define defer_chain(fs, clst) remove_chain(fs, clst)
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* FAT handling - Stretch or Create a cluster chain                      */
 /*-----------------------------------------------------------------------*/
 #if !_FS_READONLY
+#define create_chain(fs, clst) create_chain_at(fs, clst, 0)
+
 static
-DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
+DWORD create_chain_at (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
 	FATFS* fs,			/* File system object */
-	DWORD clst			/* Cluster# to stretch. 0 means create a new chain. */
+	DWORD clst,			/* Cluster# to stretch. 0 means create a new chain. */
+	DWORD scl			/* Cluster# to start searching after. 0 means default. */
 )
 {
-	DWORD cs, ncl, scl;
+	DWORD cs, ncl;
 	FRESULT res;
 
 
+	if (scl >= fs->n_fatent) scl = 0;
 	if (clst == 0) {		/* Create a new chain */
-		scl = fs->last_clust;			/* Get suggested start point */
+		if (!scl) scl = fs->last_clust;	/* Get suggested start point */
 		if (!scl || scl >= fs->n_fatent) scl = 1;
 	}
 	else {					/* Stretch the current chain */
@@ -964,7 +989,7 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 		if (cs < 2) return 1;			/* Invalid value */
 		if (cs == 0xFFFFFFFF) return cs;	/* A disk error occurred */
 		if (cs < fs->n_fatent) return cs;	/* It is already followed by next cluster */
-		scl = clst;
+		if (!scl) scl = clst;
 	}
 
 	ncl = scl;				/* Start cluster */
@@ -997,6 +1022,47 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 
 	return ncl;		/* Return new cluster number or error code */
 }
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Stretch or Create a cluster chain of file data         */
+/*-----------------------------------------------------------------------*/
+/* The file tail works as a per-file allocation hint. While the cluster
+/  after the tail is free the file grows contiguously. Otherwise another
+/  file is growing there, so a new region is started _FS_ALLOC_GAP clusters
+/  after the latest allocation instead of interleaving with that file.
+/  New files start right after the latest allocation, as usual. */
+#if _FS_ALLOC_GAP
+static
+DWORD create_data_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk error, >=2:New cluster# */
+	FATFS* fs,			/* File system object */
+	DWORD clst			/* Cluster# to stretch. 0 means create a new chain. */
+)
+{
+	DWORD cs, scl;
+
+
+	if (clst == 0)						/* New files start after the latest allocation */
+		return create_chain(fs, clst);
+
+	cs = get_fat(fs, clst);
+	if (cs < 2 || cs == 0xFFFFFFFF || cs < fs->n_fatent)	/* Error or already followed */
+		return create_chain(fs, clst);
+	if (clst + 1 < fs->n_fatent && get_fat(fs, clst + 1) == 0)	/* Next one free? */
+		return create_chain(fs, clst);
+
+	scl = fs->last_clust;				/* Start a new region */
+	if (!scl || scl >= fs->n_fatent) return create_chain(fs, clst);
+	scl += _FS_ALLOC_GAP;
+	if (scl >= fs->n_fatent) scl = scl - fs->n_fatent + 2;	/* Wrap around */
+
+	return create_chain_at(fs, clst, scl);
+}
+#else
+#define create_data_chain(fs, clst) create_chain(fs, clst)
+#endif
 #endif /* !_FS_READONLY */
 
 
@@ -2475,9 +2541,11 @@ FRESULT f_open (
 				dj.fs->wflag = 1;
 				if (cl) {						/* Remove the cluster chain if exist */
 					dw = dj.fs->winsect;
-					res = remove_chain(dj.fs, cl);
+					res = defer_chain(dj.fs, cl);
 					if (res == FR_OK) {
+#if !_FS_RECLAIM
 						dj.fs->last_clust = cl - 1;	/* Reuse the cluster hole */
+#endif
 						res = move_window(dj.fs, dw);
 					}
 				}
@@ -2675,14 +2743,14 @@ FRESULT f_write (
 				if (fp->fptr == 0) {		/* On the top of the file? */
 					clst = fp->sclust;		/* Follow from the origin */
 					if (clst == 0)			/* When no cluster is allocated, */
-						clst = create_chain(fp->fs, 0);	/* Create a new cluster chain */
+						clst = create_data_chain(fp->fs, 0);	/* Create a new cluster chain */
 				} else {					/* Middle or end of the file */
 #if _USE_FASTSEEK
 					if (fp->cltbl)
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					else
 #endif
-						clst = create_chain(fp->fs, fp->clust);	/* Follow or stretch cluster chain on the FAT */
+						clst = create_data_chain(fp->fs, fp->clust);	/* Follow or stretch cluster chain on the FAT */
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
 				if (clst == 1) ABORT(fp->fs, FR_INT_ERR);
@@ -3079,7 +3147,7 @@ FRESULT f_lseek (
 				clst = fp->sclust;						/* start from the first cluster */
 #if !_FS_READONLY
 				if (clst == 0) {						/* If no cluster chain, create a new chain */
-					clst = create_chain(fp->fs, 0);
+					clst = create_data_chain(fp->fs, 0);
 					if (clst == 1) ABORT(fp->fs, FR_INT_ERR);
 					if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
 					fp->sclust = clst;
@@ -3091,7 +3159,7 @@ FRESULT f_lseek (
 				while (ofs > bcs) {						/* Cluster following loop */
 #if !_FS_READONLY
 					if (fp->flag & FA_WRITE) {			/* Check if in write mode or not */
-						clst = create_chain(fp->fs, clst);	/* Force stretch if in write mode */
+						clst = create_data_chain(fp->fs, clst);	/* Force stretch if in write mode */
 						if (clst == 0) {				/* When disk gets full, clip file size */
 							ofs = bcs; break;
 						}
@@ -3450,7 +3518,7 @@ FRESULT f_truncate (
 			fp->fsize = fp->fptr;	/* Set file size to current R/W point */
 			fp->flag |= FA__WRITTEN;
 			if (fp->fptr == 0) {	/* When set file size to zero, remove entire cluster chain */
-				res = remove_chain(fp->fs, fp->sclust);
+				res = defer_chain(fp->fs, fp->sclust);
 				fp->sclust = 0;
 			} else {				/* When truncate a part of the file, remove remaining clusters */
 				ncl = get_fat(fp->fs, fp->clust);
@@ -3459,7 +3527,7 @@ FRESULT f_truncate (
 				if (ncl == 1) res = FR_INT_ERR;
 				if (res == FR_OK && ncl < fp->fs->n_fatent) {
 					res = put_fat(fp->fs, fp->clust, 0x0FFFFFFF);
-					if (res == FR_OK) res = remove_chain(fp->fs, ncl);
+					if (res == FR_OK) res = defer_chain(fp->fs, ncl);
 				}
 			}
 #if !_FS_TINY
@@ -3536,7 +3604,7 @@ FRESULT f_unlink (
 			if (res == FR_OK) {
 				res = dir_remove(&dj);		/* Remove the directory entry */
 				if (res == FR_OK && dclst)	/* Remove the cluster chain if exist */
-					res = remove_chain(dj.fs, dclst);
+					res = defer_chain(dj.fs, dclst);
 				if (res == FR_OK) res = sync_fs(dj.fs);
 			}
 		}
@@ -3549,6 +3617,61 @@ FRESULT f_unlink (
 
 
 
+#if _FS_RECLAIM
+/*-----------------------------------------------------------------------*/
+/* Free a Part of Deferred Cluster Chain                                 */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_reclaim (
+	FATFS* fs,		/* File system object the chain was deferred on */
+	WORD id,		/* Mount ID of the file system at the time of deferring */
+	DWORD* clst,	/* Cluster# to continue from (in), 0 when chain is done (out) */
+	UINT n			/* Maximum number of clusters to free */
+)
+{
+	FRESULT res;
+	DWORD nxt;
+
+
+	if (!fs || !fs->fs_type || fs->id != id) {	/* Volume has been remounted */
+		*clst = 0;
+		return FR_INVALID_OBJECT;
+	}
+
+	ENTER_FF(fs);
+
+	if (!fs->fs_type || fs->id != id) {	/* Remounted or formatted while waiting for lock */
+		*clst = 0;
+		LEAVE_FF(fs, FR_INVALID_OBJECT);
+	}
+
+	res = FR_OK;
+	while (n-- && *clst >= 2 && *clst < fs->n_fatent) {
+		nxt = get_fat(fs, *clst);			/* Get cluster status */
+		if (nxt == 0) { *clst = 0; break; }	/* Empty cluster? */
+		if (nxt == 1) { res = FR_INT_ERR; break; }
+		if (nxt == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		res = put_fat(fs, *clst, 0);		/* Mark the cluster "empty" */
+		if (res != FR_OK) break;
+		if (fs->free_clust != 0xFFFFFFFF) {	/* Update FSINFO */
+			fs->free_clust++;
+			fs->fsi_flag |= 1;
+		}
+		*clst = nxt;
+	}
+
+	if (res != FR_OK || *clst < 2 || *clst >= fs->n_fatent) {	/* Failed or end of chain */
+		*clst = 0;
+		if (res == FR_OK) res = sync_fs(fs);
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Create a Directory                                                    */
 /*-----------------------------------------------------------------------*/
@@ -237,6 +237,9 @@ FRESULT f_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT f_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
 FRESULT f_mkfs (const TCHAR* path, BYTE sfd, UINT au);				/* Create a file system on the volume */
 FRESULT f_fdisk (BYTE pdrv, const DWORD szt[], void* work);			/* Divide a physical drive into some partitions */
+#if _FS_RECLAIM
+FRESULT f_reclaim (FATFS* fs, WORD id, DWORD* clst, UINT n);		/* Free part of a deferred cluster chain */
+#endif
 int f_putc (TCHAR c, FIL* fp);										/* Put a character to the file */
 int f_puts (const TCHAR* str, FIL* cp);								/* Put a string to the file */
 int f_printf (FIL* fp, const TCHAR* str, ...);						/* Put a formatted string to the file */
@@ -274,6 +277,11 @@ void ff_memfree (void* mblock);			/* Free memory block */
 #endif
 #endif
 
+/* Deferred cluster reclaim */
+#if _FS_RECLAIM
+int ff_defer_chain (FATFS* fs, DWORD clst);	/* Queue a cluster chain for f_reclaim() */
+#endif
+
 /* Sync functions */
 #if _FS_REENTRANT
 int ff_cre_syncobj (BYTE vol, _SYNC_t* sobj);	/* Create a sync object */
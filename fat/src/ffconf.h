@@ -59,8 +59,11 @@
 /  f_findfirst() and f_findnext(). (0:Disable or 1:Enable) */
 
 
+#ifndef _USE_MKFS
 #define	_USE_MKFS		0
-/* This option switches f_mkfs() function. (0:Disable or 1:Enable) */
+#endif
+/* This option switches f_mkfs() function. (0:Disable or 1:Enable)
+/  uosFormatFat() is available when this is enabled. */
 
 
 #define	_USE_FASTSEEK	0
@@ -156,8 +159,18 @@
 / Drive/Volume Configurations
 /---------------------------------------------------------------------------*/
 
-#define _VOLUMES	1
-/* Number of volumes (logical drives) to be used. */
+#ifndef _VOLUMES
+#if UOSCFG_MAX_MOUNT > 9
+#define _VOLUMES	9
+#else
+#define _VOLUMES	UOSCFG_MAX_MOUNT
+#endif
+#endif
+/* Number of volumes (logical drives) to be used. Volume number is the disk
+/  number returned by uosAddDisk(), so by default there are as many volumes
+/  as there are disk table entries, but at most 9 (volume number is one
+/  digit in drive path). With _FS_REENTRANT each volume has
+/  a semaphore of it's own, so volumes can be accessed in parallel. */
 
 
 #define _STR_VOLUME_ID	0
@@ -236,6 +249,35 @@
 /      lock feature is independent of re-entrancy. */
 
 
+#ifndef _FS_ALLOC_GAP
+#if defined(UOSCFG_FAT_ALLOC_GAP)
+#define _FS_ALLOC_GAP	UOSCFG_FAT_ALLOC_GAP
+#else
+#define _FS_ALLOC_GAP	0
+#endif
+#endif
+/* The _FS_ALLOC_GAP option (picoos-micro extension) keeps files that are
+/  written concurrently contiguous. A file grows from its own tail while the
+/  next cluster is free. When it is not, allocation continues this many
+/  clusters after the latest allocated cluster of the volume, leaving room
+/  for the file that is growing there. 0 uses the default FatFs allocation. */
+
+
+#ifndef _FS_RECLAIM
+#if defined(UOSCFG_FAT_RECLAIM) && UOSCFG_FAT_RECLAIM > 0 && _FS_READONLY == 0
+#define _FS_RECLAIM	1
+#else
+#define _FS_RECLAIM	0
+#endif
+#endif
+/* The _FS_RECLAIM option (picoos-micro extension) switches deferred cluster
+/  reclaim. When enabled, f_unlink(), f_truncate() and f_open() with
+/  FA_CREATE_ALWAYS hand removed cluster chains to ff_defer_chain() instead
+/  of freeing them immediately. Chains stay allocated in the FAT until they
+/  are freed with f_reclaim(), so they are never allocated while pending.
+/  Interrupted reclaim leaves lost clusters, but never a corrupted file. */
+
+
 #ifndef _FS_REENTRANT
 #if _FS_READONLY == 1
 #define _FS_REENTRANT	0
@@ -69,6 +69,76 @@ UOS_BITTAB_TABLE(FIL, UOSCFG_FAT);
 static FatFSBittab mountedFats;
 static FILBittab      openFiles;
 
+#if _FS_RECLAIM
+
+#ifndef UOSCFG_FAT_RECLAIM_PRIO
+#define UOSCFG_FAT_RECLAIM_PRIO 1
+#endif
+
+#define RECLAIM_BATCH 32
+
+/*
+ * Cluster chain waiting for reclaim task.
+ */
+typedef struct {
+
+  FATFS* fs;
+  WORD   id;
+  DWORD  clst;
+} ReclaimChain;
+
+static ReclaimChain reclaimQueue[UOSCFG_FAT_RECLAIM];
+static int          reclaimHead;
+static int          reclaimCount;
+static POSMUTEX_t   reclaimMutex;
+static POSSEMA_t    reclaimSema;
+static ReclaimChain reclaimCurrent;
+static POSMUTEX_t   reclaimBatchMutex;
+
+static void reclaimInit(void);
+#if _USE_MKFS
+static void reclaimCancel(FATFS* fs);
+#endif
+
+#endif
+
+#if defined(UOSCFG_FAT_FLUSH_MS) && UOSCFG_FAT_FLUSH_MS > 0 && _FS_READONLY == 0
+
+#define FAT_FLUSH 1
+
+#ifndef UOSCFG_FAT_FLUSH_SECTORS
+#define UOSCFG_FAT_FLUSH_SECTORS 64
+#endif
+
+#ifndef UOSCFG_FAT_FLUSH_PRIO
+#define UOSCFG_FAT_FLUSH_PRIO 1
+#endif
+
+/*
+ * File that has been written within this time is considered
+ * to be actively written.
+ */
+#define FLUSH_ACTIVE MS(UOSCFG_FAT_FLUSH_MS / 4)
+
+/*
+ * Dirty state of open files for flusher task,
+ * indexed by openFiles slot. Flusher holds flushMutex
+ * while syncing a file so that it cannot be closed
+ * under it.
+ */
+static bool       flushDirty[UOSCFG_FAT];
+static JIF_t      flushSince[UOSCFG_FAT];
+static JIF_t      flushLast[UOSCFG_FAT];
+static int        flushPending;
+static POSSEMA_t  flushSema;
+static POSMUTEX_t flushMutex;
+
+static void flushInit(void);
+static void flushMarkDirty(FIL* f, int len);
+static void flushMarkClean(FIL* f);
+
+#endif
+
 static int fatInit(const UosFS*);
 static int fatOpen(const UosFS* mount, UosFile* file, const char *name, int flags, int mode);
 static int fatClose(UosFile* file);
@@ -112,12 +182,28 @@ static const UosFileConf uosFatFileConf = {
 static int fatInit(const UosFS* fs)
 {
   FatFS* m = (FatFS*) fs;
+
+#if _FS_RECLAIM
+  reclaimInit();
+#endif
+
+#if FAT_FLUSH
+  flushInit();
+#endif
+
   f_mount(&m->fat, m->drive, 1);
   return 0;
 }
 
 int uosMountFat(const char* mountPoint, int diskNumber)
 {
+  if (diskNumber < 0 || diskNumber >= _VOLUMES) {
+
+    nosPrintf("fatFs: disk %d is not a valid volume\n", diskNumber);
+    errno = ENODEV;
+    return -1;
+  }
+
   int slot = UOS_BITTAB_ALLOC(mountedFats);
   if (slot == -1) {
 
@@ -239,13 +325,25 @@ static int fatClose(UosFile* file)
   P_ASSERT("fatClose", file->fs->cf == &uosFatFSConf);
 
   FIL* f = (FIL*)file->fsPriv;
+
+#if FAT_FLUSH
+  nosMutexLock(flushMutex);
+  flushMarkClean(f);
+#endif
+
   if (f_close(f) != 0) {
 
+#if FAT_FLUSH
+    nosMutexUnlock(flushMutex);
+#endif
     errno = EIO;
     return -1;
   }
 
   UOS_BITTAB_FREE(openFiles, UOS_BITTAB_SLOT(openFiles, f));
+#if FAT_FLUSH
+  nosMutexUnlock(flushMutex);
+#endif
   return 0;
 }
 
@@ -285,6 +383,10 @@ static int fatWrite(UosFile* file, const char *buf, int len)
     return -1;
   }
 
+#if FAT_FLUSH
+  flushMarkDirty(f, retLen);
+#endif
+
   return retLen;
 }
 
@@ -319,6 +421,10 @@ static int fatSync(UosFile* file)
 
   FRESULT fr;
 
+#if FAT_FLUSH
+  flushMarkClean(f);
+#endif
+
   fr = f_sync(f);
   if (fr != FR_OK) {
 
@@ -329,6 +435,120 @@ static int fatSync(UosFile* file)
   return 0;
 }
 
+#if _USE_MKFS
+
+/*
+ * Run f_mkfs. Erase block alignment can push cluster count
+ * of volume just below FAT32 minimum, in which case f_mkfs
+ * aborts. Retry with smaller clusters then.
+ */
+static FRESULT mkfs(const char* drive, int options, UINT au)
+{
+  FRESULT fr;
+
+  while ((fr = f_mkfs(drive, (options & UOS_FAT_FORMAT_SFD) ? 1 : 0, au)) == FR_MKFS_ABORTED && au > 1)
+    au /= 2;
+
+  return fr;
+}
+
+int uosFormatFat(int diskNumber, int options)
+{
+  FRESULT fr;
+  FATFS* fs = NULL;
+  FatFS* m;
+  DWORD eraseBlock;
+  UINT au;
+  char drive[3];
+  int slot;
+
+  if (diskNumber < 0 || diskNumber >= _VOLUMES) {
+
+    nosPrintf("fatFs: disk %d is not a valid volume\n", diskNumber);
+    errno = ENODEV;
+    return -1;
+  }
+
+  drive[0] = diskNumber + '0';
+  drive[1] = ':';
+  drive[2] = '\0';
+
+  if (options & UOS_FAT_FORMAT_STREAMING)
+    au = 128;   // Largest cluster FatFs supports (64 KiB).
+  else
+    au = 0;     // Let f_mkfs select by volume size.
+
+// Use work area of mounted filesystem if there is one.
+
+  for (slot = 0; slot < UOSCFG_MAX_MOUNT; slot++) {
+
+    if (UOS_BITTAB_IS_FREE(mountedFats, slot))
+      continue;
+
+    m = UOS_BITTAB_ELEM(mountedFats, slot);
+    if (m->drive[0] == drive[0]) {
+
+      fs = &m->fat;
+      break;
+    }
+  }
+
+/*
+ * f_mkfs initializes disk and aligns data area start to erase
+ * block. As both erase block and cluster size are powers of two,
+ * clusters never cross erase block boundaries.
+ */
+  if (fs == NULL) {
+
+    FATFS* tmp = nosMemAlloc(sizeof(FATFS));
+    if (tmp == NULL) {
+
+      errno = ENOMEM;
+      return -1;
+    }
+
+    fr = f_mount(tmp, drive, 0);
+    if (fr == FR_OK)
+      fr = mkfs(drive, options, au);
+
+#if _FS_RECLAIM
+    reclaimCancel(tmp);
+#endif
+
+// FatFs keeps pointer to work area until it is unregistered.
+
+    if (f_mount(NULL, drive, 0) != FR_OK) {
+
+      nosPrintf("fatFs: cannot unregister format work area\n");
+      errno = EIO;
+      return -1;
+    }
+
+    nosMemFree(tmp);
+  }
+  else {
+
+#if _FS_RECLAIM
+    reclaimCancel(fs);
+#endif
+    fr = mkfs(drive, options, au);
+  }
+
+  if (fr != FR_OK) {
+
+    errno = EIO;
+    return -1;
+  }
+
+// f_mkfs cannot align to erase blocks larger than 16 MiB.
+
+  if (disk_ioctl(diskNumber, GET_BLOCK_SIZE, &eraseBlock) == RES_OK && eraseBlock > 32768)
+    nosPrintf("fatFs: erase block too large for alignment\n");
+
+  return 0;
+}
+
+#endif
 #endif
 
 static int fatStat(const UosFS* fs, const char* fn, UosFileInfo* st)
@@ -483,7 +703,20 @@ DRESULT disk_ioctl(BYTE pdrv,
   if (disk == NULL)
     return STA_NOINIT;
 
-  return disk->cf->ioctl(disk, cmd, buff);
+  DRESULT res = disk->cf->ioctl(disk, cmd, buff);
+
+/*
+ * f_mkfs aligns data area using erase block size, which
+ * works only if it is a power of two (MMC may report something else).
+ */
+  if (res == RES_OK && cmd == GET_BLOCK_SIZE) {
+
+    DWORD n = *(DWORD*)buff;
+    if (n == 0 || (n & (n - 1)))
+      *(DWORD*)buff = 1;
+  }
+
+  return res;
 }
 #endif
 
@@ -507,7 +740,7 @@ int ff_cre_syncobj(BYTE vol, _SYNC_t* sem)
 int ff_del_syncobj(_SYNC_t sem)
 {
   nosSemaDestroy(sem);
-  return 0;
+  return 1;
 }
 
 /*
@@ -531,6 +764,269 @@ void ff_rel_grant(_SYNC_t sem)
 
 #endif
 
+#if _FS_RECLAIM
+
+/*
+ * Low-priority task that frees cluster chains
+ * removed by f_unlink, f_truncate and f_open. Volume lock
+ * is released between batches so other tasks are not
+ * blocked for long.
+ */
+static void reclaimTask(void* arg)
+{
+  while (true) {
+
+    nosSemaWait(reclaimSema, INFINITE);
+
+    nosMutexLock(reclaimBatchMutex);
+    nosMutexLock(reclaimMutex);
+
+// Queue may be empty if reclaimCancel removed the entry.
+
+    if (reclaimCount > 0) {
+
+      reclaimCurrent = reclaimQueue[reclaimHead];
+      reclaimHead = (reclaimHead + 1) % UOSCFG_FAT_RECLAIM;
+      --reclaimCount;
+    }
+    else
+      reclaimCurrent.clst = 0;
+
+    nosMutexUnlock(reclaimMutex);
+
+    while (reclaimCurrent.clst != 0) {
+
+      if (f_reclaim(reclaimCurrent.fs, reclaimCurrent.id, &reclaimCurrent.clst, RECLAIM_BATCH) != FR_OK)
+        nosPrintf("fatFs: cluster reclaim failed\n");
+
+// Give reclaimCancel a chance between batches.
+
+      nosMutexUnlock(reclaimBatchMutex);
+      nosMutexLock(reclaimBatchMutex);
+    }
+
+    nosMutexUnlock(reclaimBatchMutex);
+  }
+}
+
+static void reclaimInit()
+{
+  if (reclaimMutex != NULL)
+    return;
+
+  reclaimMutex      = nosMutexCreate(0, "fatrcl");
+  reclaimBatchMutex = nosMutexCreate(0, "fatrclb");
+  reclaimSema       = nosSemaCreate(0, 0, "fatrcl");
+  P_ASSERT("reclaimInit", reclaimMutex != NULL && reclaimBatchMutex != NULL && reclaimSema != NULL);
+
+  nosTaskCreate(reclaimTask, NULL, UOSCFG_FAT_RECLAIM_PRIO, 0, "fatrcl");
+}
+
+#if _USE_MKFS
+
+/*
+ * Drop chains queued for filesystem and wait until
+ * batch in progress is done. Must be called without volume
+ * lock before volume is formatted or unregistered.
+ */
+static void reclaimCancel(FATFS* fs)
+{
+  ReclaimChain c;
+  int i, n;
+
+  if (reclaimMutex == NULL)
+    return;
+
+  nosMutexLock(reclaimBatchMutex);
+
+  if (reclaimCurrent.fs == fs)
+    reclaimCurrent.clst = 0;
+
+  nosMutexLock(reclaimMutex);
+
+  n = 0;
+  for (i = 0; i < reclaimCount; i++) {
+
+    c = reclaimQueue[(reclaimHead + i) % UOSCFG_FAT_RECLAIM];
+    if (c.fs != fs)
+      reclaimQueue[(reclaimHead + n++) % UOSCFG_FAT_RECLAIM] = c;
+  }
+
+  reclaimCount = n;
+
+  nosMutexUnlock(reclaimMutex);
+  nosMutexUnlock(reclaimBatchMutex);
+}
+
+#endif
+
+/*
+ * Queue cluster chain for reclaim task. Called by FatFs
+ * with volume locked. Returns 0 if chain must be removed
+ * immediately.
+ */
+int ff_defer_chain(FATFS* fs, DWORD clst)
+{
+  bool queued = false;
+
+  if (reclaimMutex == NULL)
+    return 0;
+
+  nosMutexLock(reclaimMutex);
+
+  if (reclaimCount < UOSCFG_FAT_RECLAIM) {
+
+    ReclaimChain* c = &reclaimQueue[(reclaimHead + reclaimCount) % UOSCFG_FAT_RECLAIM];
+
+    c->fs   = fs;
+    c->id   = fs->id;
+    c->clst = clst;
+    ++reclaimCount;
+    queued = true;
+  }
+
+  nosMutexUnlock(reclaimMutex);
+
+  if (queued)
+    nosSemaSignal(reclaimSema);
+
+  return queued;
+}
+
+#endif
+
+#if FAT_FLUSH
+
+/*
+ * Low-priority task that writes back files which have
+ * been dirty for longer than half of UOSCFG_FAT_FLUSH_MS
+ * or all dirty files when UOSCFG_FAT_FLUSH_SECTORS worth
+ * of data has been written. Files that are actively written
+ * are left alone until they have been dirty for
+ * UOSCFG_FAT_FLUSH_MS, so that sync doesn't keep breaking
+ * multiple block writes of disk driver. Running at low priority
+ * keeps writeback away from busy periods.
+ */
+static void flushTask(void* arg)
+{
+  int slot;
+  bool all;
+  bool active;
+  FIL* f;
+
+  while (true) {
+
+    all = (nosSemaWait(flushSema, MS(UOSCFG_FAT_FLUSH_MS / 2)) == 0);
+
+    for (slot = 0; slot < UOSCFG_FAT; slot++) {
+
+      nosMutexLock(flushMutex);
+      if (UOS_BITTAB_IS_FREE(openFiles, slot)) {
+
+        nosMutexUnlock(flushMutex);
+        continue;
+      }
+
+      posTaskSchedLock();
+      active = POS_TIMEAFTER(flushLast[slot] + FLUSH_ACTIVE, jiffies);
+      if (flushDirty[slot] &&
+          (active ? !POS_TIMEAFTER(flushSince[slot] + MS(UOSCFG_FAT_FLUSH_MS), jiffies) :
+                    (all || !POS_TIMEAFTER(flushSince[slot] + MS(UOSCFG_FAT_FLUSH_MS / 2), jiffies)))) {
+
+        flushDirty[slot] = false;
+        f = UOS_BITTAB_ELEM(openFiles, slot);
+      }
+      else
+        f = NULL;
+
+      posTaskSchedUnlock();
+
+/*
+ * Keep file dirty if sync fails, so that it is retried
+ * later. Error is also returned by next sync or close.
+ */
+      if (f != NULL && f_sync(f) != FR_OK) {
+
+        nosPrintf("fatFs: background sync failed\n");
+
+        posTaskSchedLock();
+        if (!flushDirty[slot]) {
+
+          flushDirty[slot] = true;
+          flushSince[slot] = jiffies;
+        }
+
+        posTaskSchedUnlock();
+      }
+
+      nosMutexUnlock(flushMutex);
+    }
+
+    posTaskSchedLock();
+    flushPending = 0;
+    posTaskSchedUnlock();
+
+#if _USE_IOCTL
+/*
+ * Let disk drivers close multiple block transfers
+ * that have been left open but idle.
+ */
+    for (slot = 0; slot < UOSCFG_MAX_MOUNT; slot++) {
+
+      if (UOS_BITTAB_IS_FREE(mountedFats, slot))
+        continue;
+
+      disk_ioctl(UOS_BITTAB_ELEM(mountedFats, slot)->drive[0] - '0', CTRL_IDLE, NULL);
+    }
+#endif
+  }
+}
+
+static void flushInit()
+{
+  if (flushSema != NULL)
+    return;
+
+  flushSema = nosSemaCreate(0, 0, "fatflush");
+  P_ASSERT("flushInit", flushSema != NULL);
+
+  flushMutex = nosMutexCreate(0, "fatflush");
+  P_ASSERT("flushInit", flushMutex != NULL);
+
+  nosTaskCreate(flushTask, NULL, UOSCFG_FAT_FLUSH_PRIO, 0, "fatflush");
+}
+
+static void flushMarkDirty(FIL* f, int len)
+{
+  int slot = UOS_BITTAB_SLOT(openFiles, f);
+  bool wakeup;
+
+  posTaskSchedLock();
+
+  if (!flushDirty[slot]) {
+
+    flushDirty[slot] = true;
+    flushSince[slot] = jiffies;
+  }
+
+  flushLast[slot] = jiffies;
+  wakeup = flushPending < UOSCFG_FAT_FLUSH_SECTORS * _MAX_SS;
+  flushPending += len;
+  wakeup = wakeup && flushPending >= UOSCFG_FAT_FLUSH_SECTORS * _MAX_SS;
+
+  posTaskSchedUnlock();
+
+  if (wakeup)
+    nosSemaSignal(flushSema);
+}
+
+static void flushMarkClean(FIL* f)
+{
+  flushDirty[UOS_BITTAB_SLOT(openFiles, f)] = false;
+}
+
+#endif
+
 #if _USE_LFN == 3
 
 /*
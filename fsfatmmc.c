@@ -23,6 +23,7 @@
 #if UOSCFG_FAT_MMC > 0
 
 #include <stdbool.h>
+#include <string.h>
 #include "ff.h"
 #include "diskio.h"
 
@@ -30,6 +31,7 @@
 
 #define CMD0    (0)       /* GO_IDLE_STATE */
 #define CMD1    (1)       /* SEND_OP_COND (MMC) */
+#define CMD6    (6)       /* SWITCH_FUNC (SDC) */
 #define ACMD41  (0x80+41) /* SEND_OP_COND (SDC) */
 #define CMD8    (8)       /* SEND_IF_COND */
 #define CMD9    (9)       /* SEND_CSD */
@@ -48,12 +50,79 @@
 #define CMD38   (38)      /* ERASE */
 #define CMD55   (55)      /* APP_CMD */
 #define CMD58   (58)      /* READ_OCR */
+#define CMD59   (59)      /* CRC_ON_OFF */
+
+/*
+ * Open streams are closed after idle timeout by FAT
+ * flusher task (CTRL_IDLE). Without it streams are closed
+ * after each request.
+ */
+#if defined(UOSCFG_FAT_FLUSH_MS) && UOSCFG_FAT_FLUSH_MS > 0 && _FS_READONLY == 0 && _USE_IOCTL
+#define IDLE_POLL 1
+#else
+#define IDLE_POLL 0
+#endif
+
+#ifndef UOSCFG_FAT_MMC_STREAM_MS
+#if IDLE_POLL
+#define UOSCFG_FAT_MMC_STREAM_MS 100
+#else
+#define UOSCFG_FAT_MMC_STREAM_MS 0
+#endif
+#endif
+
+#if UOSCFG_FAT_MMC_STREAM_MS > 0 && !IDLE_POLL
+#error UOSCFG_FAT_MMC_STREAM_MS requires UOSCFG_FAT_FLUSH_MS
+#endif
+
+#ifndef UOSCFG_FAT_MMC_CRC
+#define UOSCFG_FAT_MMC_CRC 0
+#endif
+
+#ifndef UOSCFG_FAT_MMC_RETRIES
+#if UOSCFG_FAT_MMC_CRC > 0
+#define UOSCFG_FAT_MMC_RETRIES 3
+#else
+#define UOSCFG_FAT_MMC_RETRIES 0
+#endif
+#endif
+
+#ifndef UOSCFG_FAT_MMC_BUSY_SPIN
+#define UOSCFG_FAT_MMC_BUSY_SPIN 200
+#endif
+
+#ifndef UOSCFG_FAT_MMC_BUSY_SLEEP_MS
+#define UOSCFG_FAT_MMC_BUSY_SLEEP_MS 8
+#endif
+
+#ifndef UOSCFG_FAT_MMC_MAX_HZ
+#define UOSCFG_FAT_MMC_MAX_HZ 25000000
+#endif
+
+#ifndef UOSCFG_FAT_MMC_HIGH_SPEED
+#define UOSCFG_FAT_MMC_HIGH_SPEED 0
+#endif
+
+#if _FS_READONLY == 1
+#undef UOSCFG_FAT_MMC_STAGE
+#endif
+
+#ifndef UOSCFG_FAT_MMC_STAGE
+#define UOSCFG_FAT_MMC_STAGE 0
+#endif
+
+#if UOSCFG_FAT_MMC_STAGE & (UOSCFG_FAT_MMC_STAGE - 1)
+#error UOSCFG_FAT_MMC_STAGE must be a power of two
+#endif
 
 #define TMO(ms) (jiffies + MS(ms))
 #define EXPIRED(tm) POS_TIMEAFTER(jiffies, tm)
 
-static volatile DSTATUS Stat = STA_NOINIT;  /* Disk status */
-static BYTE CardType;                       /* b0:MMC, b1:SDC, b2:Block addressing */
+/*
+ * Disk status. STA_NOINIT is derived from card type,
+ * so that statically zeroed disk is not initialized.
+ */
+#define STAT(disk) ((disk)->stat | ((disk)->cardType ? 0 : STA_NOINIT))
 
 static int diskInit(const UosDisk* disk);
 static int diskStatus(const UosDisk* disk);
@@ -76,6 +145,266 @@ const UosDiskConf uosMmcDiskConf = {
   .ioctl  = diskIoctl
 };
 
+#if UOSCFG_FAT_MMC_CRC > 0
+
+/*
+ * CRC7 for command frames. Table contains CRC
+ * shifted left by one bit, as it appears in frame.
+ */
+static const BYTE crc7Table[256] = {
+  0x00, 0x12, 0x24, 0x36, 0x48, 0x5A, 0x6C, 0x7E, 0x90, 0x82, 0xB4, 0xA6,
+  0xD8, 0xCA, 0xFC, 0xEE, 0x32, 0x20, 0x16, 0x04, 0x7A, 0x68, 0x5E, 0x4C,
+  0xA2, 0xB0, 0x86, 0x94, 0xEA, 0xF8, 0xCE, 0xDC, 0x64, 0x76, 0x40, 0x52,
+  0x2C, 0x3E, 0x08, 0x1A, 0xF4, 0xE6, 0xD0, 0xC2, 0xBC, 0xAE, 0x98, 0x8A,
+  0x56, 0x44, 0x72, 0x60, 0x1E, 0x0C, 0x3A, 0x28, 0xC6, 0xD4, 0xE2, 0xF0,
+  0x8E, 0x9C, 0xAA, 0xB8, 0xC8, 0xDA, 0xEC, 0xFE, 0x80, 0x92, 0xA4, 0xB6,
+  0x58, 0x4A, 0x7C, 0x6E, 0x10, 0x02, 0x34, 0x26, 0xFA, 0xE8, 0xDE, 0xCC,
+  0xB2, 0xA0, 0x96, 0x84, 0x6A, 0x78, 0x4E, 0x5C, 0x22, 0x30, 0x06, 0x14,
+  0xAC, 0xBE, 0x88, 0x9A, 0xE4, 0xF6, 0xC0, 0xD2, 0x3C, 0x2E, 0x18, 0x0A,
+  0x74, 0x66, 0x50, 0x42, 0x9E, 0x8C, 0xBA, 0xA8, 0xD6, 0xC4, 0xF2, 0xE0,
+  0x0E, 0x1C, 0x2A, 0x38, 0x46, 0x54, 0x62, 0x70, 0x82, 0x90, 0xA6, 0xB4,
+  0xCA, 0xD8, 0xEE, 0xFC, 0x12, 0x00, 0x36, 0x24, 0x5A, 0x48, 0x7E, 0x6C,
+  0xB0, 0xA2, 0x94, 0x86, 0xF8, 0xEA, 0xDC, 0xCE, 0x20, 0x32, 0x04, 0x16,
+  0x68, 0x7A, 0x4C, 0x5E, 0xE6, 0xF4, 0xC2, 0xD0, 0xAE, 0xBC, 0x8A, 0x98,
+  0x76, 0x64, 0x52, 0x40, 0x3E, 0x2C, 0x1A, 0x08, 0xD4, 0xC6, 0xF0, 0xE2,
+  0x9C, 0x8E, 0xB8, 0xAA, 0x44, 0x56, 0x60, 0x72, 0x0C, 0x1E, 0x28, 0x3A,
+  0x4A, 0x58, 0x6E, 0x7C, 0x02, 0x10, 0x26, 0x34, 0xDA, 0xC8, 0xFE, 0xEC,
+  0x92, 0x80, 0xB6, 0xA4, 0x78, 0x6A, 0x5C, 0x4E, 0x30, 0x22, 0x14, 0x06,
+  0xE8, 0xFA, 0xCC, 0xDE, 0xA0, 0xB2, 0x84, 0x96, 0x2E, 0x3C, 0x0A, 0x18,
+  0x66, 0x74, 0x42, 0x50, 0xBE, 0xAC, 0x9A, 0x88, 0xF6, 0xE4, 0xD2, 0xC0,
+  0x1C, 0x0E, 0x38, 0x2A, 0x54, 0x46, 0x70, 0x62, 0x8C, 0x9E, 0xA8, 0xBA,
+  0xC4, 0xD6, 0xE0, 0xF2
+};
+
+/*
+ * CRC16-CCITT for data blocks. crc16TableN contains CRC of
+ * byte followed by N zero bytes, which allows processing
+ * UOSCFG_FAT_MMC_CRC (1, 2 or 4) bytes per table round.
+ */
+static const WORD crc16Table0[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
+
+#if UOSCFG_FAT_MMC_CRC >= 2
+static const WORD crc16Table1[256] = {
+  0x0000, 0x3331, 0x6662, 0x5553, 0xCCC4, 0xFFF5, 0xAAA6, 0x9997,
+  0x89A9, 0xBA98, 0xEFCB, 0xDCFA, 0x456D, 0x765C, 0x230F, 0x103E,
+  0x0373, 0x3042, 0x6511, 0x5620, 0xCFB7, 0xFC86, 0xA9D5, 0x9AE4,
+  0x8ADA, 0xB9EB, 0xECB8, 0xDF89, 0x461E, 0x752F, 0x207C, 0x134D,
+  0x06E6, 0x35D7, 0x6084, 0x53B5, 0xCA22, 0xF913, 0xAC40, 0x9F71,
+  0x8F4F, 0xBC7E, 0xE92D, 0xDA1C, 0x438B, 0x70BA, 0x25E9, 0x16D8,
+  0x0595, 0x36A4, 0x63F7, 0x50C6, 0xC951, 0xFA60, 0xAF33, 0x9C02,
+  0x8C3C, 0xBF0D, 0xEA5E, 0xD96F, 0x40F8, 0x73C9, 0x269A, 0x15AB,
+  0x0DCC, 0x3EFD, 0x6BAE, 0x589F, 0xC108, 0xF239, 0xA76A, 0x945B,
+  0x8465, 0xB754, 0xE207, 0xD136, 0x48A1, 0x7B90, 0x2EC3, 0x1DF2,
+  0x0EBF, 0x3D8E, 0x68DD, 0x5BEC, 0xC27B, 0xF14A, 0xA419, 0x9728,
+  0x8716, 0xB427, 0xE174, 0xD245, 0x4BD2, 0x78E3, 0x2DB0, 0x1E81,
+  0x0B2A, 0x381B, 0x6D48, 0x5E79, 0xC7EE, 0xF4DF, 0xA18C, 0x92BD,
+  0x8283, 0xB1B2, 0xE4E1, 0xD7D0, 0x4E47, 0x7D76, 0x2825, 0x1B14,
+  0x0859, 0x3B68, 0x6E3B, 0x5D0A, 0xC49D, 0xF7AC, 0xA2FF, 0x91CE,
+  0x81F0, 0xB2C1, 0xE792, 0xD4A3, 0x4D34, 0x7E05, 0x2B56, 0x1867,
+  0x1B98, 0x28A9, 0x7DFA, 0x4ECB, 0xD75C, 0xE46D, 0xB13E, 0x820F,
+  0x9231, 0xA100, 0xF453, 0xC762, 0x5EF5, 0x6DC4, 0x3897, 0x0BA6,
+  0x18EB, 0x2BDA, 0x7E89, 0x4DB8, 0xD42F, 0xE71E, 0xB24D, 0x817C,
+  0x9142, 0xA273, 0xF720, 0xC411, 0x5D86, 0x6EB7, 0x3BE4, 0x08D5,
+  0x1D7E, 0x2E4F, 0x7B1C, 0x482D, 0xD1BA, 0xE28B, 0xB7D8, 0x84E9,
+  0x94D7, 0xA7E6, 0xF2B5, 0xC184, 0x5813, 0x6B22, 0x3E71, 0x0D40,
+  0x1E0D, 0x2D3C, 0x786F, 0x4B5E, 0xD2C9, 0xE1F8, 0xB4AB, 0x879A,
+  0x97A4, 0xA495, 0xF1C6, 0xC2F7, 0x5B60, 0x6851, 0x3D02, 0x0E33,
+  0x1654, 0x2565, 0x7036, 0x4307, 0xDA90, 0xE9A1, 0xBCF2, 0x8FC3,
+  0x9FFD, 0xACCC, 0xF99F, 0xCAAE, 0x5339, 0x6008, 0x355B, 0x066A,
+  0x1527, 0x2616, 0x7345, 0x4074, 0xD9E3, 0xEAD2, 0xBF81, 0x8CB0,
+  0x9C8E, 0xAFBF, 0xFAEC, 0xC9DD, 0x504A, 0x637B, 0x3628, 0x0519,
+  0x10B2, 0x2383, 0x76D0, 0x45E1, 0xDC76, 0xEF47, 0xBA14, 0x8925,
+  0x991B, 0xAA2A, 0xFF79, 0xCC48, 0x55DF, 0x66EE, 0x33BD, 0x008C,
+  0x13C1, 0x20F0, 0x75A3, 0x4692, 0xDF05, 0xEC34, 0xB967, 0x8A56,
+  0x9A68, 0xA959, 0xFC0A, 0xCF3B, 0x56AC, 0x659D, 0x30CE, 0x03FF
+};
+#endif
+
+#if UOSCFG_FAT_MMC_CRC >= 4
+static const WORD crc16Table2[256] = {
+  0x0000, 0x3730, 0x6E60, 0x5950, 0xDCC0, 0xEBF0, 0xB2A0, 0x8590,
+  0xA9A1, 0x9E91, 0xC7C1, 0xF0F1, 0x7561, 0x4251, 0x1B01, 0x2C31,
+  0x4363, 0x7453, 0x2D03, 0x1A33, 0x9FA3, 0xA893, 0xF1C3, 0xC6F3,
+  0xEAC2, 0xDDF2, 0x84A2, 0xB392, 0x3602, 0x0132, 0x5862, 0x6F52,
+  0x86C6, 0xB1F6, 0xE8A6, 0xDF96, 0x5A06, 0x6D36, 0x3466, 0x0356,
+  0x2F67, 0x1857, 0x4107, 0x7637, 0xF3A7, 0xC497, 0x9DC7, 0xAAF7,
+  0xC5A5, 0xF295, 0xABC5, 0x9CF5, 0x1965, 0x2E55, 0x7705, 0x4035,
+  0x6C04, 0x5B34, 0x0264, 0x3554, 0xB0C4, 0x87F4, 0xDEA4, 0xE994,
+  0x1DAD, 0x2A9D, 0x73CD, 0x44FD, 0xC16D, 0xF65D, 0xAF0D, 0x983D,
+  0xB40C, 0x833C, 0xDA6C, 0xED5C, 0x68CC, 0x5FFC, 0x06AC, 0x319C,
+  0x5ECE, 0x69FE, 0x30AE, 0x079E, 0x820E, 0xB53E, 0xEC6E, 0xDB5E,
+  0xF76F, 0xC05F, 0x990F, 0xAE3F, 0x2BAF, 0x1C9F, 0x45CF, 0x72FF,
+  0x9B6B, 0xAC5B, 0xF50B, 0xC23B, 0x47AB, 0x709B, 0x29CB, 0x1EFB,
+  0x32CA, 0x05FA, 0x5CAA, 0x6B9A, 0xEE0A, 0xD93A, 0x806A, 0xB75A,
+  0xD808, 0xEF38, 0xB668, 0x8158, 0x04C8, 0x33F8, 0x6AA8, 0x5D98,
+  0x71A9, 0x4699, 0x1FC9, 0x28F9, 0xAD69, 0x9A59, 0xC309, 0xF439,
+  0x3B5A, 0x0C6A, 0x553A, 0x620A, 0xE79A, 0xD0AA, 0x89FA, 0xBECA,
+  0x92FB, 0xA5CB, 0xFC9B, 0xCBAB, 0x4E3B, 0x790B, 0x205B, 0x176B,
+  0x7839, 0x4F09, 0x1659, 0x2169, 0xA4F9, 0x93C9, 0xCA99, 0xFDA9,
+  0xD198, 0xE6A8, 0xBFF8, 0x88C8, 0x0D58, 0x3A68, 0x6338, 0x5408,
+  0xBD9C, 0x8AAC, 0xD3FC, 0xE4CC, 0x615C, 0x566C, 0x0F3C, 0x380C,
+  0x143D, 0x230D, 0x7A5D, 0x4D6D, 0xC8FD, 0xFFCD, 0xA69D, 0x91AD,
+  0xFEFF, 0xC9CF, 0x909F, 0xA7AF, 0x223F, 0x150F, 0x4C5F, 0x7B6F,
+  0x575E, 0x606E, 0x393E, 0x0E0E, 0x8B9E, 0xBCAE, 0xE5FE, 0xD2CE,
+  0x26F7, 0x11C7, 0x4897, 0x7FA7, 0xFA37, 0xCD07, 0x9457, 0xA367,
+  0x8F56, 0xB866, 0xE136, 0xD606, 0x5396, 0x64A6, 0x3DF6, 0x0AC6,
+  0x6594, 0x52A4, 0x0BF4, 0x3CC4, 0xB954, 0x8E64, 0xD734, 0xE004,
+  0xCC35, 0xFB05, 0xA255, 0x9565, 0x10F5, 0x27C5, 0x7E95, 0x49A5,
+  0xA031, 0x9701, 0xCE51, 0xF961, 0x7CF1, 0x4BC1, 0x1291, 0x25A1,
+  0x0990, 0x3EA0, 0x67F0, 0x50C0, 0xD550, 0xE260, 0xBB30, 0x8C00,
+  0xE352, 0xD462, 0x8D32, 0xBA02, 0x3F92, 0x08A2, 0x51F2, 0x66C2,
+  0x4AF3, 0x7DC3, 0x2493, 0x13A3, 0x9633, 0xA103, 0xF853, 0xCF63
+};
+
+static const WORD crc16Table3[256] = {
+  0x0000, 0x76B4, 0xED68, 0x9BDC, 0xCAF1, 0xBC45, 0x2799, 0x512D,
+  0x85C3, 0xF377, 0x68AB, 0x1E1F, 0x4F32, 0x3986, 0xA25A, 0xD4EE,
+  0x1BA7, 0x6D13, 0xF6CF, 0x807B, 0xD156, 0xA7E2, 0x3C3E, 0x4A8A,
+  0x9E64, 0xE8D0, 0x730C, 0x05B8, 0x5495, 0x2221, 0xB9FD, 0xCF49,
+  0x374E, 0x41FA, 0xDA26, 0xAC92, 0xFDBF, 0x8B0B, 0x10D7, 0x6663,
+  0xB28D, 0xC439, 0x5FE5, 0x2951, 0x787C, 0x0EC8, 0x9514, 0xE3A0,
+  0x2CE9, 0x5A5D, 0xC181, 0xB735, 0xE618, 0x90AC, 0x0B70, 0x7DC4,
+  0xA92A, 0xDF9E, 0x4442, 0x32F6, 0x63DB, 0x156F, 0x8EB3, 0xF807,
+  0x6E9C, 0x1828, 0x83F4, 0xF540, 0xA46D, 0xD2D9, 0x4905, 0x3FB1,
+  0xEB5F, 0x9DEB, 0x0637, 0x7083, 0x21AE, 0x571A, 0xCCC6, 0xBA72,
+  0x753B, 0x038F, 0x9853, 0xEEE7, 0xBFCA, 0xC97E, 0x52A2, 0x2416,
+  0xF0F8, 0x864C, 0x1D90, 0x6B24, 0x3A09, 0x4CBD, 0xD761, 0xA1D5,
+  0x59D2, 0x2F66, 0xB4BA, 0xC20E, 0x9323, 0xE597, 0x7E4B, 0x08FF,
+  0xDC11, 0xAAA5, 0x3179, 0x47CD, 0x16E0, 0x6054, 0xFB88, 0x8D3C,
+  0x4275, 0x34C1, 0xAF1D, 0xD9A9, 0x8884, 0xFE30, 0x65EC, 0x1358,
+  0xC7B6, 0xB102, 0x2ADE, 0x5C6A, 0x0D47, 0x7BF3, 0xE02F, 0x969B,
+  0xDD38, 0xAB8C, 0x3050, 0x46E4, 0x17C9, 0x617D, 0xFAA1, 0x8C15,
+  0x58FB, 0x2E4F, 0xB593, 0xC327, 0x920A, 0xE4BE, 0x7F62, 0x09D6,
+  0xC69F, 0xB02B, 0x2BF7, 0x5D43, 0x0C6E, 0x7ADA, 0xE106, 0x97B2,
+  0x435C, 0x35E8, 0xAE34, 0xD880, 0x89AD, 0xFF19, 0x64C5, 0x1271,
+  0xEA76, 0x9CC2, 0x071E, 0x71AA, 0x2087, 0x5633, 0xCDEF, 0xBB5B,
+  0x6FB5, 0x1901, 0x82DD, 0xF469, 0xA544, 0xD3F0, 0x482C, 0x3E98,
+  0xF1D1, 0x8765, 0x1CB9, 0x6A0D, 0x3B20, 0x4D94, 0xD648, 0xA0FC,
+  0x7412, 0x02A6, 0x997A, 0xEFCE, 0xBEE3, 0xC857, 0x538B, 0x253F,
+  0xB3A4, 0xC510, 0x5ECC, 0x2878, 0x7955, 0x0FE1, 0x943D, 0xE289,
+  0x3667, 0x40D3, 0xDB0F, 0xADBB, 0xFC96, 0x8A22, 0x11FE, 0x674A,
+  0xA803, 0xDEB7, 0x456B, 0x33DF, 0x62F2, 0x1446, 0x8F9A, 0xF92E,
+  0x2DC0, 0x5B74, 0xC0A8, 0xB61C, 0xE731, 0x9185, 0x0A59, 0x7CED,
+  0x84EA, 0xF25E, 0x6982, 0x1F36, 0x4E1B, 0x38AF, 0xA373, 0xD5C7,
+  0x0129, 0x779D, 0xEC41, 0x9AF5, 0xCBD8, 0xBD6C, 0x26B0, 0x5004,
+  0x9F4D, 0xE9F9, 0x7225, 0x0491, 0x55BC, 0x2308, 0xB8D4, 0xCE60,
+  0x1A8E, 0x6C3A, 0xF7E6, 0x8152, 0xD07F, 0xA6CB, 0x3D17, 0x4BA3
+};
+#endif
+
+static BYTE crc7(const BYTE* p, int len)
+{
+  BYTE crc = 0;
+
+  while (len--)
+    crc = crc7Table[crc ^ *p++];
+
+  return crc | 1;   /* Stop bit */
+}
+
+static WORD crc16(const BYTE* p, int len)
+{
+  WORD crc = 0;
+#if UOSCFG_FAT_MMC_CRC >= 2
+  WORD x;
+#endif
+
+#if UOSCFG_FAT_MMC_CRC >= 4
+  while (len >= 4) {
+
+    x = crc ^ ((p[0] << 8) | p[1]);
+    crc = crc16Table3[x >> 8] ^ crc16Table2[x & 0xFF] ^ crc16Table1[p[2]] ^ crc16Table0[p[3]];
+    p += 4;
+    len -= 4;
+  }
+#endif
+
+#if UOSCFG_FAT_MMC_CRC >= 2
+  while (len >= 2) {
+
+    x = crc ^ ((p[0] << 8) | p[1]);
+    crc = crc16Table1[x >> 8] ^ crc16Table0[x & 0xFF];
+    p += 2;
+    len -= 2;
+  }
+#endif
+
+  while (len--)
+    crc = (crc << 8) ^ crc16Table0[(crc >> 8) ^ *p++];
+
+  return crc;
+}
+
+#endif
+
+/*
+ * Adaptive wait while card is busy. Poll first
+ * without delay, then sleep with exponentially growing
+ * interval so that other tasks get CPU time.
+ */
+typedef struct {
+
+  UINT spin;
+  UINT_t sleep;
+  UINT_t max;
+} Backoff;
+
+static void backoff_init(const UosMmcDisk* disk, Backoff* b)
+{
+  b->spin  = disk->busySpin ? disk->busySpin : UOSCFG_FAT_MMC_BUSY_SPIN;
+  b->sleep = 1;
+  b->max   = MS(disk->busySleepMs ? disk->busySleepMs : UOSCFG_FAT_MMC_BUSY_SLEEP_MS);
+  if (b->max < 1)           /* Less than one tick at low HZ */
+    b->max = 1;
+}
+
+static void backoff(Backoff* b)
+{
+  if (b->spin) {
+
+    --b->spin;
+    return;
+  }
+
+  posTaskSleep(b->sleep);
+
+  if (b->sleep * 2 <= b->max)
+    b->sleep *= 2;
+}
+
 /*
  * Wait for card to be ready.
  * 1:Ready, 0:Timeout
@@ -86,12 +415,11 @@ static int wait_ready(
 {
   BYTE d;
   JIF_t timeout = TMO(wt);
+  Backoff b;
 
-  do {
-
-    d = uosSpiXchg(disk->dev, 0xff);
-
-  } while (d != 0xFF && !EXPIRED(timeout));
+  backoff_init(disk, &b);
+  while ((d = uosSpiXchg(disk->dev, 0xff)) != 0xFF && !EXPIRED(timeout))
+    backoff(&b);
 
   return (d == 0xFF) ? 1 : 0;
 }
@@ -132,19 +460,26 @@ static int rcvr_datablock(
 {
   BYTE token;
   JIF_t timeout = TMO(200);
+  Backoff b;
 
-  do {                        /* Wait for data packet in timeout of 200ms */
-
-    token = uosSpiXchg(disk->dev, 0xFF);
-
-  } while ((token == 0xFF) && !EXPIRED(timeout));
+  backoff_init(disk, &b);     /* Wait for data packet in timeout of 200ms */
+  while ((token = uosSpiXchg(disk->dev, 0xFF)) == 0xFF && !EXPIRED(timeout))
+    backoff(&b);
 
   if (token != 0xFE)
     return 0;                 /* If not valid data token, retutn with error */
 
   uosSpiRcvr(disk->dev, buff, btr);       /* Receive the data block into buffer */
-  uosSpiXchg(disk->dev, 0xFF);            /* Discard CRC */
-  uosSpiXchg(disk->dev, 0xFF);
+#if UOSCFG_FAT_MMC_CRC > 0
+  WORD crc;
+
+  crc = uosSpiXchg(disk->dev, 0xFF) << 8; /* Check CRC */
+  crc |= uosSpiXchg(disk->dev, 0xFF);
+  if (crc != crc16(buff, btr))
+    return 0;
+#else
+  uosSpiSkip(disk->dev, 2);               /* Discard CRC */
+#endif
 
   return 1;                   /* Return with success */
 }
@@ -165,12 +500,28 @@ static int xmit_datablock(
   if (!wait_ready(disk, 500))
     return 0;
 
-  uosSpiXchg(disk->dev, token);             /* Xmit data token */
-  if (token != 0xFD) {                      /* Is data token */
+  if (token == 0xFD) {                      /* Stop token */
 
-    uosSpiXmit(disk->dev, buff, 512);       /* Xmit the data block to the MMC */
-    uosSpiXchg(disk->dev, 0xFF);            /* CRC (Dummy) */
-    uosSpiXchg(disk->dev, 0xFF);
+    uosSpiXchg(disk->dev, token);
+  }
+  else {
+
+    BYTE crc[2] = { 0xFF, 0xFF };           /* CRC (Dummy) */
+    UosSpiXmitSeg seg[3] = {
+
+      { &token, 1 },                        /* Data token */
+      { buff, 512 },                        /* Data block */
+      { crc, 2 }
+    };
+
+#if UOSCFG_FAT_MMC_CRC > 0
+    WORD c = crc16(buff, 512);
+
+    crc[0] = c >> 8;
+    crc[1] = c;
+#endif
+
+    uosSpiXmitV(disk->dev, seg, 3);         /* Xmit the data packet to the MMC */
 
     resp = uosSpiXchg(disk->dev, 0xFF);     /* Reveive data response */
     if ((resp & 0x1F) != 0x05)              /* If not accepted, return with error */
@@ -191,51 +542,372 @@ static BYTE send_cmd(
     DWORD arg)    /* Argument */
 {
   BYTE n, res;
+  BYTE frame[6];
+  int retry = UOSCFG_FAT_MMC_RETRIES;
+  bool acmd = (cmd & 0x80) != 0;
+
+  cmd &= 0x7F;
+
+  frame[0] = 0x40 | cmd;                /* Start + Command index */
+  frame[1] = (BYTE) (arg >> 24);        /* Argument[31..24] */
+  frame[2] = (BYTE) (arg >> 16);        /* Argument[23..16] */
+  frame[3] = (BYTE) (arg >> 8);         /* Argument[15..8] */
+  frame[4] = (BYTE) arg;                /* Argument[7..0] */
+#if UOSCFG_FAT_MMC_CRC > 0
+  frame[5] = crc7(frame, 5);            /* CRC + Stop */
+#else
+  frame[5] = 0x01;                      /* Dummy CRC + Stop */
 
-  if (cmd & 0x80) { /* ACMD<n> is the command sequense of CMD55-CMD<n> */
+  if (cmd == CMD0)
+    frame[5] = 0x95;                    /* Valid CRC for CMD0(0) + Stop */
 
-    cmd &= 0x7F;
-    res = send_cmd(disk, CMD55, 0);
-    if (res > 1)
-      return res;
-  }
+  if (cmd == CMD8)
+    frame[5] = 0x87;                    /* Valid CRC for CMD8(0x1AA) Stop */
+#endif
+
+  do {
+
+    /* ACMD<n> is the command sequense of CMD55-CMD<n>, retry must send both */
+    if (acmd) {
+
+      res = send_cmd(disk, CMD55, 0);
+      if (res > 1)
+        return res;
+    }
+
+    /* Select the card and wait for ready except to stop multiple block read */
+    if (cmd != CMD12) {
+
+      deselect(disk);
+      if (!select(disk))
+        return 0xFF;
+    }
+
+    /* Send command packet */
+    uosSpiXmit(disk->dev, frame, sizeof(frame));
+
+    /* Receive command response */
+    if (cmd == CMD12)
+      uosSpiXchg(disk->dev, 0xFF);        /* Skip a stuff byte when stop reading */
+
+    n = 10;                             /* Wait for a valid response in timeout of 10 attempts */
+    do {
+
+      res = uosSpiXchg(disk->dev, 0xFF);
+
+    } while ((res & 0x80) && --n);
+
+    /* Retry if card detected CRC error in command */
+  } while (UOSCFG_FAT_MMC_CRC > 0 && !(res & 0x80) && (res & 0x08) && cmd != CMD12 && retry--);
+
+  return res;                           /* Return with the response value */
+}
+
+/*
+ * Stop open multiple block write by sending STOP_TRAN token.
+ * SPI bus must be allocated.
+ * 1:Successful, 0:Failed
+ */
+static int stop_write(UosMmcDisk* disk)
+{
+  int ok = 1;
 
-  /* Select the card and wait for ready except to stop multiple block read */
-  if (cmd != CMD12) {
+#if _FS_READONLY != 1
+  if (disk->wrStream) {
 
+    disk->wrStream = false;
+    uosSpiCS(disk->dev, true);
+    uosSpiXchg(disk->dev, 0xFF);
+    ok = xmit_datablock(disk, 0, 0xFD);
     deselect(disk);
-    if (!select(disk))
-      return 0xFF;
   }
+#endif
 
-  /* Send command packet */
-  uosSpiXchg(disk->dev, 0x40 | cmd);                /* Start + Command index */
-  uosSpiXchg(disk->dev, (BYTE) (arg >> 24));        /* Argument[31..24] */
-  uosSpiXchg(disk->dev, (BYTE) (arg >> 16));        /* Argument[23..16] */
-  uosSpiXchg(disk->dev, (BYTE) (arg >> 8));         /* Argument[15..8] */
-  uosSpiXchg(disk->dev, (BYTE) arg);                /* Argument[7..0] */
-  n = 0x01;                             /* Dummy CRC + Stop */
+  return ok;
+}
 
-  if (cmd == CMD0)
-    n = 0x95;                           /* Valid CRC for CMD0(0) + Stop */
+/*
+ * Stop open multiple block read by sending STOP_TRANSMISSION.
+ * SPI bus must be allocated.
+ */
+static void stop_read(UosMmcDisk* disk)
+{
+  if (disk->rdStream) {
 
-  if (cmd == CMD8)
-    n = 0x87;                           /* Valid CRC for CMD8(0x1AA) Stop */
+    disk->rdStream = false;
+    uosSpiCS(disk->dev, true);
+    send_cmd(disk, CMD12, 0);
+    deselect(disk);
+  }
+}
+
+#if _FS_READONLY != 1
 
-  uosSpiXchg(disk->dev, n);
+/*
+ * Write blocks using multiple block write. Sequential writes
+ * continue same open CMD25 stream. Bus must be allocated.
+ * Returns number of blocks that could not be written.
+ */
+static int write_blocks(
+    UosMmcDisk* disk,
+    const BYTE *buff,      /* Pointer to the data to be written */
+    DWORD sector,          /* Start sector number (LBA) */
+    UINT count)            /* Sector count */
+{
+  int retry = UOSCFG_FAT_MMC_RETRIES;
 
-  /* Receive command response */
-  if (cmd == CMD12)
-    uosSpiXchg(disk->dev, 0xFF);          /* Skip a stuff byte when stop reading */
+  if (disk->wrStream && (sector != disk->wrNext || EXPIRED(disk->wrIdle)))
+    stop_write(disk);
 
-  n = 10;                               /* Wait for a valid response in timeout of 10 attempts */
   do {
 
-    res = uosSpiXchg(disk->dev, 0xFF);
+    if (disk->wrStream) {
 
-  } while ((res & 0x80) && --n);
+      uosSpiCS(disk->dev, true);    /* Continue open stream */
+      uosSpiXchg(disk->dev, 0xFF);
+    }
+    else {
 
-  return res;                           /* Return with the response value */
+      if (disk->cardType & CT_SDC)  /* Pre-erase blocks of new stream */
+        send_cmd(disk, ACMD23, count);
+
+      if (send_cmd(disk, CMD25, (disk->cardType & CT_BLOCK) ? sector : sector * 512) == 0)
+        disk->wrStream = true;      /* WRITE_MULTIPLE_BLOCK */
+    }
+
+    if (disk->wrStream) {
+
+      do {
+
+        if (!xmit_datablock(disk, buff, 0xFC))
+          break;
+
+        buff += 512;
+        ++sector;
+
+      } while (--count);
+    }
+
+    if (count)                      /* Failed, retry from failed sector */
+      stop_write(disk);
+
+  } while (count && retry--);
+
+  if (!count) {
+
+#if UOSCFG_FAT_MMC_STREAM_MS > 0
+    disk->wrNext = sector;
+    disk->wrIdle = TMO(UOSCFG_FAT_MMC_STREAM_MS);
+#else
+    if (!stop_write(disk))          /* Streams disabled */
+      count = 1;
+#endif
+  }
+
+  deselect(disk);
+  return count;
+}
+
+#if UOSCFG_FAT_MMC_STAGE > 0
+
+/*
+ * Write staged sectors to card as one pre-erased burst.
+ * 1:Ok, 0:Failed
+ */
+static int stage_flush(UosMmcDisk* disk)
+{
+  DWORD first = disk->stageFirst;
+  DWORD n = disk->stageEnd - first;
+
+  if (n == 0)
+    return 1;
+
+  disk->stageFirst = disk->stageEnd = 0;
+  return write_blocks(disk, disk->stageBuf + (first & (disk->stageSize - 1)) * 512, first, n) == 0;
+}
+
+/*
+ * Collect write into staging buffer. Buffer covers one
+ * aligned window of erase block, contiguous writes into it
+ * are collected and written when window becomes full or when
+ * something else must be written or read.
+ * 1:Staged, 0:Not suitable for staging
+ */
+static int stage_write(
+    UosMmcDisk* disk,
+    const BYTE *buff,
+    DWORD sector,
+    UINT count,
+    int* ok)
+{
+  DWORD win = sector & ~(disk->stageSize - 1);
+  DWORD end = sector + count;
+
+  if (end > win + disk->stageSize)
+    return 0;       /* Crosses window, write directly */
+
+  if (disk->stageFirst != disk->stageEnd) {
+
+    if ((disk->stageFirst & ~(disk->stageSize - 1)) != win ||
+        sector > disk->stageEnd ||
+        end < disk->stageFirst)
+      *ok = stage_flush(disk);  /* Not contiguous with staged data */
+  }
+
+  memcpy(disk->stageBuf + (sector - win) * 512, buff, count * 512);
+  if (disk->stageFirst == disk->stageEnd) {
+
+    disk->stageFirst = sector;
+    disk->stageEnd = end;
+  }
+  else {
+
+    if (sector < disk->stageFirst)
+      disk->stageFirst = sector;
+
+    if (end > disk->stageEnd)
+      disk->stageEnd = end;
+  }
+
+  if (disk->stageFirst == win && disk->stageEnd == win + disk->stageSize)
+    *ok &= stage_flush(disk);   /* Window full */
+
+  return 1;
+}
+
+#endif
+
+#endif
+
+/*
+ * Get max clock rate from TRAN_SPEED field of CSD.
+ */
+static DWORD tran_speed(const BYTE* csd)
+{
+  static const DWORD unit[] = { 10000, 100000, 1000000, 10000000 };
+  static const BYTE value[] = { 0, 10, 12, 13, 15, 20, 25, 30,
+                                35, 40, 45, 50, 55, 60, 70, 80 };
+
+  if (csd[3] & 0x04)           /* Reserved units */
+    return 0;
+
+  return unit[csd[3] & 0x03] * value[(csd[3] >> 3) & 0x0F];
+}
+
+#if UOSCFG_FAT_MMC_HIGH_SPEED > 0
+
+/*
+ * Switch SD card to high speed mode with CMD6.
+ * Card reports new TRAN_SPEED in CSD after switching.
+ * 1:Switched, 0:Not supported or failed
+ */
+static int switch_high_speed(UosMmcDisk* disk)
+{
+  BYTE st[64];
+
+  /* Check if function 1 of group 1 (high speed) is supported */
+  if (send_cmd(disk, CMD6, 0x00FFFFF1) != 0 || !rcvr_datablock(disk, st, 64))
+    return 0;
+
+  if (!(st[13] & 0x02))
+    return 0;
+
+  /* Switch to it */
+  if (send_cmd(disk, CMD6, 0x80FFFFF1) != 0 || !rcvr_datablock(disk, st, 64))
+    return 0;
+
+  return (st[16] & 0x0F) == 1;
+}
+
+#endif
+
+/*
+ * Set SPI clock according to card CSD, limited
+ * by board maximum. Optionally switch card to high speed
+ * mode if board can go faster than default speed.
+ */
+static void set_clock(
+    UosMmcDisk* disk,
+    BYTE ty)          /* Card type */
+{
+  DWORD max = disk->maxClock ? disk->maxClock : UOSCFG_FAT_MMC_MAX_HZ;
+  DWORD hz = tran_speed(disk->csd);
+
+#if UOSCFG_FAT_MMC_HIGH_SPEED > 0
+  if ((ty & CT_SDC) && max > hz) {
+
+    uosSpiSetClock(disk->dev, hz);
+    if (switch_high_speed(disk) &&
+        send_cmd(disk, CMD9, 0) == 0 &&
+        rcvr_datablock(disk, disk->csd, 16))
+      hz = tran_speed(disk->csd);
+  }
+#endif
+
+  if (hz == 0 || hz > max)
+    hz = max;
+
+  disk->clock = uosSpiSetClock(disk->dev, hz);
+}
+
+/*
+ * Read CSD and CID registers into disk and calculate
+ * number of sectors and erase block size from them. For SDv2
+ * cards erase block size and speed class come from SD status.
+ * 1:Successful, 0:Failed
+ */
+static int read_card_info(
+    UosMmcDisk* disk,
+    BYTE ty)          /* Card type */
+{
+  BYTE n, sdstat[64];
+  DWORD csize;
+  const BYTE* csd = disk->csd;
+  static const BYTE speedClass[] = { 0, 2, 4, 6, 10 };
+
+  if (send_cmd(disk, CMD9, 0) != 0 || !rcvr_datablock(disk, disk->csd, 16))
+    return 0;
+
+  if (send_cmd(disk, CMD10, 0) != 0 || !rcvr_datablock(disk, disk->cid, 16))
+    return 0;
+
+  if ((csd[0] >> 6) == 1) { /* SDC ver 2.00 */
+
+    csize = csd[9] + ((WORD) csd[8] << 8) + ((DWORD) (csd[7] & 63) << 16) + 1;
+    disk->sectorCount = csize << 10;
+  }
+  else { /* SDC ver 1.XX or MMC*/
+
+    n = (csd[5] & 15) + ((csd[10] & 128) >> 7) + ((csd[9] & 3) << 1) + 2;
+    csize = (csd[8] >> 6) + ((WORD) csd[7] << 2) + ((WORD) (csd[6] & 3) << 10) + 1;
+    disk->sectorCount = csize << (n - 9);
+  }
+
+  disk->eraseBlock = 1;   /* Unknown */
+  disk->speedClass = 0;
+  if (ty & CT_SD2) { /* SDv2 */
+
+    if (send_cmd(disk, ACMD13, 0) == 0) { /* Read SD status */
+
+      uosSpiXchg(disk->dev, 0xFF);
+      if (rcvr_datablock(disk, sdstat, 64)) {
+
+        disk->eraseBlock = 16UL << (sdstat[10] >> 4);
+        if (sdstat[8] < sizeof(speedClass))
+          disk->speedClass = speedClass[sdstat[8]];
+      }
+    }
+  }
+  else if (ty & CT_SD1) { /* SDv1 */
+
+    disk->eraseBlock = (((csd[10] & 63) << 1) + ((WORD) (csd[11] & 128) >> 7) + 1) << ((csd[13] >> 6) - 1);
+  }
+  else { /* MMCv3 */
+
+    disk->eraseBlock = ((WORD) ((csd[10] & 124) >> 2) + 1) * (((csd[11] & 3) << 3) + ((csd[11] & 224) >> 5) + 1);
+  }
+
+  return 1;
 }
 
 /*
@@ -243,26 +915,73 @@ static BYTE send_cmd(
  */
 static int diskInit(const UosDisk* adisk)
 {
-  const UosMmcDisk* disk = (const UosMmcDisk*)adisk;
+  UosMmcDisk* disk = (UosMmcDisk*)adisk;
   BYTE n, cmd, ty, ocr[4];
+#if UOSCFG_FAT_MMC_STAGE > 0
+  DWORD first, end;
+  int ok;
+#endif
 
-//  if (pdrv)
-//    return STA_NOINIT;        /* Supports only single drive */
+  if (disk->cardType) {             /* Finish pending writes before card is reset */
+
+    uosSpiBeginNoCS(disk->dev);
+    stop_read(disk);
+#if UOSCFG_FAT_MMC_STAGE > 0
+    first = disk->stageFirst;
+    end = disk->stageEnd;
+    ok = stage_flush(disk);
+    ok &= stop_write(disk);
+#else
+    stop_write(disk);
+#endif
+    uosSpiEnd(disk->dev);
 
+#if UOSCFG_FAT_MMC_STAGE > 0
+/*
+ * Keep staged sectors and card if they cannot be written,
+ * next init tries again. Data is lost only if card is gone.
+ */
+    if (!ok && first != end) {
+
+      if (!(disk->stat & STA_NODISK)) {
+
+        disk->stageFirst = first;
+        disk->stageEnd = end;
+        nosPrintf("mmc: cannot write staged sectors\n");
+        return STA_NOINIT;
+      }
+
+      nosPrintf("mmc: staged sectors lost\n");
+    }
+#endif
+  }
+
+  disk->cardType = 0;
+  disk->wrStream = false;
+  disk->rdStream = false;
+#if UOSCFG_FAT_MMC_STAGE > 0
+  disk->stageFirst = disk->stageEnd = 0;
+  disk->stageSize = 0;
+#endif
   disk->cf->close(disk);            /* Turn off the socket power to reset the card */
-  if (Stat & STA_NODISK)
-    return Stat;                /* No card in the socket */
+  if (disk->stat & STA_NODISK)
+    return STAT(disk);          /* No card in the socket */
 
   uosSpiBeginNoCS(disk->dev);
-  uosSpiControl(disk->dev->bus, false);
+  uosSpiSetClock(disk->dev, 400000);
 
   disk->cf->open(disk);             /* Turn on the socket power */
 
-  for (n = 10; n; n--)
-    uosSpiXchg(disk->dev, 0xFF);      /* 80 dummy clocks */
+  uosSpiSkip(disk->dev, 10);        /* 80 dummy clocks */
 
   ty = 0;
-  if (send_cmd(disk, CMD0, 0) == 1) { /* Enter Idle state */
+  n = send_cmd(disk, CMD0, 0);        /* Enter Idle state */
+#if UOSCFG_FAT_MMC_CRC > 0
+  if (n == 1)
+    n = send_cmd(disk, CMD59, 1);     /* Turn CRC checking on */
+#endif
+
+  if (n == 1) {
 
     JIF_t timeout = TMO(1000);
     if (send_cmd(disk, CMD8, 0x1AA) == 1) { /* SDv2? */
@@ -305,36 +1024,54 @@ static int diskInit(const UosDisk* adisk)
     }
   }
 
-  CardType = ty;
-  uosSpiControl(disk->dev->bus, true);
-  deselect(disk);
+  if (ty && !read_card_info(disk, ty))
+    ty = 0;
+
+  if (ty)
+    set_clock(disk, ty);
 
-  if (ty) { /* Initialization succeded */
+#if UOSCFG_FAT_MMC_STAGE > 0
+  if (ty) {
 
-    Stat &= ~STA_NOINIT; /* Clear STA_NOINIT */
+    if (disk->stageBuf == NULL)
+      disk->stageBuf = nosMemAlloc(UOSCFG_FAT_MMC_STAGE * 512);
+
+    if (disk->stageBuf != NULL) {
+
+      disk->stageSize = UOSCFG_FAT_MMC_STAGE;
+      while (disk->stageSize > disk->eraseBlock && disk->eraseBlock > 1)
+        disk->stageSize >>= 1;
+    }
   }
-  else { /* Initialization failed */
+#endif
+
+  deselect(disk);
 
+  if (!ty) /* Initialization failed */
     disk->cf->close(disk);
-  }
 
+  disk->cardType = ty;
   uosSpiEnd(disk->dev);
-  return Stat;
+  return STAT(disk);
 }
 
 /*
  * Get Disk Status
  */
-static int diskStatus(const UosDisk* disk)
+static int diskStatus(const UosDisk* adisk)
 {
-//  if (pdrv)
-//    return STA_NOINIT; /* Supports only single drive */
+  const UosMmcDisk* disk = (const UosMmcDisk*)adisk;
 
-  return Stat;
+  return STAT(disk);
 }
 
 /*
- * Read Sector(s)
+ * Read Sector(s). Multiple block read (CMD18) is left open
+ * after last block, so that next sequential read can continue
+ * it without new command. Stream is stopped by non-sequential
+ * read, write, ioctl or when idle timeout has passed (checked
+ * by next read and CTRL_IDLE). Single sector that does not
+ * continue previous read is read with CMD17, which needs no stop.
  */
 static int diskRead(
     const UosDisk* adisk,     /* Physical drive */
@@ -342,33 +1079,77 @@ static int diskRead(
     int sector,               /* Start sector number (LBA) */
     int count)                /* Sector count (1..128) */
 {
-  const UosMmcDisk* disk = (const UosMmcDisk*)adisk;
-  BYTE cmd;
+  UosMmcDisk* disk = (UosMmcDisk*)adisk;
+  int retry = UOSCFG_FAT_MMC_RETRIES;
+  DWORD addr;
 
-  //if (pdrv || !count)
   if (!count)
     return RES_PARERR;
 
-  if (Stat & STA_NOINIT)
+  if (STAT(disk) & STA_NOINIT)
     return RES_NOTRDY;
 
   uosSpiBeginNoCS(disk->dev);
-  if (!(CardType & CT_BLOCK))
-    sector *= 512;                  /* Convert to byte address if needed */
+#if UOSCFG_FAT_MMC_STAGE > 0
+  if (disk->stageFirst < (DWORD)(sector + count) && disk->stageEnd > (DWORD)sector) {
 
-  cmd = count > 1 ? CMD18 : CMD17;  /*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
-  if (send_cmd(disk, cmd, sector) == 0) {
+    stop_read(disk);
+    if (!stage_flush(disk)) {       /* Staged data must be on card before reading it */
 
-    do {
+      uosSpiEnd(disk->dev);
+      return RES_ERROR;
+    }
+  }
+#endif
+
+  stop_write(disk);
+
+  if (disk->rdStream && (sector != disk->rdNext || EXPIRED(disk->rdIdle)))
+    stop_read(disk);
+
+  do {
+
+    addr = (disk->cardType & CT_BLOCK) ? sector : sector * 512;
+    if (disk->rdStream)
+      uosSpiCS(disk->dev, true);    /* Continue open stream, card may already send data token */
+    else if (count == 1 && sector != disk->rdNext) {
+
+      if (send_cmd(disk, CMD17, addr) == 0 && rcvr_datablock(disk, buff, 512)) {
+
+        ++sector;                   /* READ_SINGLE_BLOCK, no stop needed */
+        count = 0;
+      }
+
+      continue;
+    }
+    else if (send_cmd(disk, CMD18, addr) == 0)
+      disk->rdStream = true;        /* READ_MULTIPLE_BLOCK */
+
+    if (disk->rdStream) {
+
+      do {
+
+        if (!rcvr_datablock(disk, buff, 512))
+          break;
+
+        buff += 512;
+        ++sector;
+      } while (--count);
+    }
 
-      if (!rcvr_datablock(disk, buff, 512))
-        break;
+    if (count)                      /* Failed, retry from failed sector */
+      stop_read(disk);
 
-      buff += 512;
-    } while (--count);
+  } while (count && retry--);
 
-    if (cmd == CMD18)
-      send_cmd(disk, CMD12, 0);            /* STOP_TRANSMISSION */
+  if (!count) {
+
+#if UOSCFG_FAT_MMC_STREAM_MS > 0
+    disk->rdNext = sector;
+    disk->rdIdle = TMO(UOSCFG_FAT_MMC_STREAM_MS);
+#else
+    stop_read(disk);                /* Streams disabled */
+#endif
   }
 
   deselect(disk);
@@ -378,62 +1159,49 @@ static int diskRead(
 }
 
 /*
- * Write Sector(s)
+ * Write Sector(s). Multiple block write (CMD25) is left open
+ * after last block, so that next sequential write can continue
+ * it without command and stop token overhead. Stream is
+ * stopped by non-sequential write, read, ioctl or when
+ * next write arrives after idle timeout.
  */
 #if _FS_READONLY != 1
-int diskWrite(
+static int diskWrite(
     const UosDisk* adisk,  /* Physical drive */
     const uint8_t *buff,   /* Pointer to the data to be written */
     int sector,            /* Start sector number (LBA) */
     int count)             /* Sector count (1..128) */
 {
-  const UosMmcDisk* disk = (const UosMmcDisk*)adisk;
-  //if (pdrv || !count)
+  UosMmcDisk* disk = (UosMmcDisk*)adisk;
+  int ok = 1;
+
   if (!count)
     return RES_PARERR;
 
-  if (Stat & STA_NOINIT)
+  if (STAT(disk) & STA_NOINIT)
     return RES_NOTRDY;
 
-  if (Stat & STA_PROTECT)
+  if (disk->stat & STA_PROTECT)
     return RES_WRPRT;
 
   uosSpiBeginNoCS(disk->dev);
+  stop_read(disk);
 
-  if (!(CardType & CT_BLOCK))
-    sector *= 512; /* Convert to byte address if needed */
-
-  if (count == 1) { /* Single block write */
+#if UOSCFG_FAT_MMC_STAGE > 0
+  if (!disk->stageSize || !stage_write(disk, buff, sector, count, &ok)) {
 
-    if ((send_cmd(disk, CMD24, sector) == 0) /* WRITE_BLOCK */
-        && xmit_datablock(disk, buff, 0xFE))
-    count = 0;
-  }
-  else { /* Multiple block write */
-
-    if (CardType & CT_SDC)
-      send_cmd(disk, ACMD23, count);
-
-    if (send_cmd(disk, CMD25, sector) == 0) { /* WRITE_MULTIPLE_BLOCK */
-
-      do {
-
-        if (!xmit_datablock(disk, buff, 0xFC))
-          break;
-
-        buff += 512;
-
-      } while (--count);
-
-      if (!xmit_datablock(disk, 0, 0xFD)) /* STOP_TRAN token */
-        count = 1;
-    }
+    ok = stage_flush(disk);
+    if (write_blocks(disk, buff, sector, count))
+      ok = 0;
   }
+#else
+  if (write_blocks(disk, buff, sector, count))
+    ok = 0;
+#endif
 
-  deselect(disk);
   uosSpiEnd(disk->dev);
 
-  return count ? RES_ERROR : RES_OK;
+  return ok ? RES_OK : RES_ERROR;
 }
 #endif
 
@@ -446,102 +1214,84 @@ static int diskIoctl(
     uint8_t cmd,            /* Control code */
     void *buff)             /* Buffer to send/receive control data */
 {
-  const UosMmcDisk* disk = (const UosMmcDisk*)adisk;
+  UosMmcDisk* disk = (UosMmcDisk*)adisk;
   DRESULT res;
-  BYTE n, csd[16], *ptr = buff;
-  DWORD csize;
-
-//  if (pdrv)
- //   return RES_PARERR;
+  BYTE n, *ptr = buff;
 
   res = RES_ERROR;
 
-  if (Stat & STA_NOINIT)
+  if (STAT(disk) & STA_NOINIT)
     return RES_NOTRDY;
 
-  uosSpiBeginNoCS(disk->dev);
+  /* Information cached at initialization doesn't need the card */
   switch (cmd)
   {
-  case CTRL_SYNC: /* Make sure that no pending write process. Do not remove this or written sector might not left updated. */
-    if (select(disk))
-      res = RES_OK;
-
-    break;
-
   case GET_SECTOR_COUNT: /* Get number of sectors on the disk (DWORD) */
-    if ((send_cmd(disk, CMD9, 0) == 0) && rcvr_datablock(disk, csd, 16)) {
-
-      if ((csd[0] >> 6) == 1) { /* SDC ver 2.00 */
-
-        csize = csd[9] + ((WORD) csd[8] << 8) + ((DWORD) (csd[7] & 63) << 16) + 1;
-        *(DWORD*) buff = csize << 10;
-      }
-      else { /* SDC ver 1.XX or MMC*/
-
-        n = (csd[5] & 15) + ((csd[10] & 128) >> 7) + ((csd[9] & 3) << 1) + 2;
-        csize = (csd[8] >> 6) + ((WORD) csd[7] << 2) + ((WORD) (csd[6] & 3) << 10) + 1;
-        *(DWORD*) buff = csize << (n - 9);
-      }
-
-      res = RES_OK;
-    }
-    break;
+    *(DWORD*) buff = disk->sectorCount;
+    return RES_OK;
 
   case GET_BLOCK_SIZE: /* Get erase block size in unit of sector (DWORD) */
-    if (CardType & CT_SD2) { /* SDv2? */
-
-      if (send_cmd(disk, ACMD13, 0) == 0) { /* Read SD status */
+    *(DWORD*) buff = disk->eraseBlock;
+    return RES_OK;
 
-        uosSpiXchg(disk->dev, 0xFF);
-        if (rcvr_datablock(disk, csd, 16)) { /* Read partial block */
-
-          for (n = 64 - 16; n; n--)
-            uosSpiXchg(disk->dev, 0xFF); /* Purge trailing data */
+    /* Following commands are never used by FatFs module */
 
-          *(DWORD*) buff = 16UL << (csd[10] >> 4);
-          res = RES_OK;
-        }
-      }
-    }
-    else { /* SDv1 or MMCv3 */
+  case MMC_GET_TYPE: /* Get card type flags (1 byte) */
+    *ptr = disk->cardType;
+    return RES_OK;
 
-      if ((send_cmd(disk, CMD9, 0) == 0) && rcvr_datablock(disk, csd, 16)) { /* Read CSD */
+  case MMC_GET_CSD: /* Get CSD read at initialization (16 bytes) */
+    memcpy(ptr, disk->csd, 16);
+    return RES_OK;
 
-        if (CardType & CT_SD1) { /* SDv1 */
+  case MMC_GET_CID: /* Get CID read at initialization (16 bytes) */
+    memcpy(ptr, disk->cid, 16);
+    return RES_OK;
 
-          *(DWORD*) buff = (((csd[10] & 63) << 1) + ((WORD) (csd[11] & 128) >> 7) + 1) << ((csd[13] >> 6) - 1);
-        }
-        else { /* MMCv3 */
+  case MMC_GET_SPEED_CLASS: /* Get SD speed class read at initialization (1 byte) */
+    *ptr = disk->speedClass;
+    return RES_OK;
+  }
 
-          *(DWORD*) buff = ((WORD) ((csd[10] & 124) >> 2) + 1) * (((csd[11] & 3) << 3) + ((csd[11] & 224) >> 5) + 1);
-        }
+/*
+ * Don't take the bus for idle check if no stream is open.
+ * Flags are checked again below with bus held.
+ */
+  if (cmd == CTRL_IDLE && !disk->rdStream && !disk->wrStream)
+    return RES_OK;
 
-        res = RES_OK;
-      }
-    }
-    break;
+  uosSpiBeginNoCS(disk->dev);
+  if (cmd == CTRL_IDLE) { /* Stop streams that have been idle longer than timeout */
 
-    /* Following commands are never used by FatFs module */
+    if (disk->rdStream && EXPIRED(disk->rdIdle))
+      stop_read(disk);
 
-  case MMC_GET_TYPE: /* Get card type flags (1 byte) */
-    *ptr = CardType;
     res = RES_OK;
-    break;
+    if (disk->wrStream && EXPIRED(disk->wrIdle) && !stop_write(disk))
+      res = RES_ERROR;
 
-  case MMC_GET_CSD: /* Receive CSD as a data block (16 bytes) */
-    if (send_cmd(disk, CMD9, 0) == 0 /* READ_CSD */ &&
-        rcvr_datablock(disk, ptr, 16))
-      res = RES_OK;
+    uosSpiEnd(disk->dev);
+    return res;
+  }
 
-    break;
+  stop_read(disk);
+#if UOSCFG_FAT_MMC_STAGE > 0
+  n = stage_flush(disk);
+  n &= stop_write(disk);
+#else
+  n = stop_write(disk);
+#endif
 
-  case MMC_GET_CID: /* Receive CID as a data block (16 bytes) */
-    if (send_cmd(disk, CMD10, 0) == 0 /* READ_CID */ &&
-        rcvr_datablock(disk, ptr, 16))
+  switch (cmd)
+  {
+  case CTRL_SYNC: /* Make sure that no pending write process. Do not remove this or written sector might not left updated. */
+    if (n && select(disk))
       res = RES_OK;
 
     break;
 
+    /* Following commands are never used by FatFs module */
+
   case MMC_GET_OCR: /* Receive OCR as an R3 resp (4 bytes) */
     if (send_cmd(disk, CMD58, 0) == 0) { /* READ_OCR */
 
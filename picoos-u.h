@@ -149,7 +149,42 @@ struct uosSpiBus;
 struct uosSpiDev;
 
 /**
- * Config for generic SPI bus.
+ * Segment of scatter-gather transmit.
+ */
+typedef struct {
+
+  const uint8_t* data;
+  int len;
+} UosSpiXmitSeg;
+
+/**
+ * Segment of scatter-gather receive.
+ */
+typedef struct {
+
+  uint8_t* data;
+  int len;
+} UosSpiRcvrSeg;
+
+/**
+ * Config for generic SPI bus. Only init, cs and xchg
+ * are mandatory. Transfer is used by uosSpiTransfer and
+ * for blocks if xmit or rcvr is missing. If it is missing too,
+ * xchg32 and xchg16 (wide frames, most significant byte first)
+ * are used for as much of data as possible before falling back
+ * to xchg. In transfer, NULL tx sends 0xff and NULL rx
+ * discards received data. Fill sends same byte repeatedly
+ * and discards received data, DMA can do this with fixed
+ * source address. XmitV and rcvrV handle segment lists,
+ * for example with linked-list DMA.
+ *
+ * Ports without DMA can provide fifoFill, fifoDrain and
+ * fifoIrq for interrupt-driven transfers. FifoFill pushes
+ * at most max bytes (0xff if tx is NULL) into transmit FIFO and
+ * fifoDrain pops at most max bytes (discarded if rx is NULL)
+ * from receive FIFO, both return number of bytes moved.
+ * FifoIrq enables or disables SPI interrupt, whose handler
+ * must call uosSpiFifoIsr.
  */
 typedef struct uosSpiBusConf {
 
@@ -159,6 +194,20 @@ typedef struct uosSpiBusConf {
   uint8_t (*xchg)(const struct uosSpiBus* bus, uint8_t data);
   void    (*xmit)(const struct uosSpiBus*, const uint8_t* data, int len);
   void    (*rcvr)(const struct uosSpiBus*, uint8_t* data, int len);
+  void    (*transfer)(const struct uosSpiBus*, const uint8_t* tx, uint8_t* rx, int len);
+  uint16_t (*xchg16)(const struct uosSpiBus* bus, uint16_t data);
+  uint32_t (*xchg32)(const struct uosSpiBus* bus, uint32_t data);
+  void    (*fill)(const struct uosSpiBus*, uint8_t pattern, int len);
+  void    (*xmitV)(const struct uosSpiBus*, const UosSpiXmitSeg* seg, int cnt);
+  void    (*rcvrV)(const struct uosSpiBus*, const UosSpiRcvrSeg* seg, int cnt);
+  bool    (*xmitAsync)(const struct uosSpiBus*, const uint8_t* data, int len);
+  bool    (*rcvrAsync)(const struct uosSpiBus*, uint8_t* data, int len);
+  uint32_t (*setClock)(struct uosSpiBus* bus, uint32_t hz);
+  void    (*setFormat)(struct uosSpiBus* bus, uint8_t mode, uint8_t wordSize);
+  int     (*fifoFill)(const struct uosSpiBus*, const uint8_t* tx, int max);
+  int     (*fifoDrain)(const struct uosSpiBus*, uint8_t* rx, int max);
+  void    (*fifoIrq)(const struct uosSpiBus*, bool enable);
+  int     fifoDepth;
 } UosSpiBusConf;
 
 /**
@@ -170,6 +219,26 @@ typedef struct uosSpiBus {
   POSMUTEX_t busMutex;
   struct uosSpiDev* currentDev;
   bool active;
+  POSSEMA_t asyncDone;
+  const uint8_t* fifoTx;    // State of interrupt-driven transfer
+  uint8_t* fifoRx;
+  int fifoTxLeft;
+  int fifoRxLeft;
+  uint32_t clock;           // Active device profile
+  uint8_t mode;
+  uint8_t wordSize;
+#if UOSCFG_SPI_RESERVE > 0
+  struct uosSpiDev* burstDev; // Bus reservation, see uosSpiReserve
+  POSTASK_t burstTask;
+  int burstLeft;
+  JIF_t burstEnd;
+#endif
+#if UOSCFG_SPI_QUEUE > 0
+  struct uosSpiTransaction* queue;
+  POSSEMA_t queueSema;
+  POSTASK_t queueTask;
+  VAR_t queuePrio;          // Current priority of queue worker
+#endif
 } UosSpiBus;
 
 /**
@@ -179,8 +248,29 @@ typedef struct __attribute__((aligned(4))) uosSpiDevConf {
 #ifdef UOSCFG_SPI_CS_TYPE
   UOSCFG_SPI_CS_TYPE cs;
 #endif
+  uint32_t clock;           // Clock rate in Hz, 0 = leave as is
+  uint8_t mode;             // SPI mode 0-3
+  uint8_t wordSize;         // Bits per word, 0 = 8
+  const char* name;         // For diagnostics, can be NULL
 } UosSpiDevConf;
 
+#if UOSCFG_SPI_STATS > 0 || DOX == 1
+
+/**
+ * Bus usage statistics for SPI device. Times are
+ * in UOSCFG_SPI_STATS_TIME units (default jiffies).
+ */
+typedef struct {
+
+  uint32_t cycles;          // Begin/end cycles
+  uint32_t bytes;           // Bytes moved
+  uint32_t holdMax;         // Max time bus was held
+  uint32_t holdTotal;       // Total time bus was held
+  uint32_t waitMax;         // Max time waited for bus
+} UosSpiStats;
+
+#endif
+
 /**
  * Generic SPI bus device.
  */
@@ -188,8 +278,36 @@ typedef struct uosSpiDev {
 
   const UosSpiDevConf* cf;
   UosSpiBus* bus;
+  uint32_t clock;           // Clock rate, initially from config
+#if UOSCFG_SPI_STATS > 0
+  UosSpiStats stats;
+  uint32_t holdStart;
+  struct uosSpiDev* next;
+#endif
 } UosSpiDev;
 
+#if UOSCFG_SPI_QUEUE > 0 || DOX == 1
+
+/**
+ * Transaction for SPI bus queue. Chip select is asserted
+ * for the duration of transaction.
+ */
+typedef struct uosSpiTransaction {
+
+  const uint8_t* tx;        // Data to transmit, NULL sends 0xff
+  uint8_t* rx;              // Buffer for received data, NULL discards it
+  int len;
+  uint8_t prio;             // Transactions with larger value run first
+  POSSEMA_t done;           // Signaled when transaction is complete, can be NULL
+  volatile bool complete;
+
+  struct uosSpiDev* dev;
+  struct uosSpiTransaction* next;
+  VAR_t taskPrio;           // Priority of submitting task
+} UosSpiTransaction;
+
+#endif
+
 /**
  * Initialize SPI bus. Must be called before any other operations.
  */
@@ -205,13 +323,24 @@ void uosSpiDevInit(UosSpiDev* dev, const UosSpiDevConf* cf, UosSpiBus* bus);
  */
 void    uosSpiControl(UosSpiBus* bus, bool fullSpeed);
 
+/**
+ * Set SPI bus clock to highest rate that does not exceed hz.
+ * Rate is remembered as device clock and restored when device
+ * uses bus next time. Returns actual rate, or 0 if port only supports
+ * uosSpiControl. Bus must be allocated with uosSpiBegin.
+ */
+uint32_t uosSpiSetClock(UosSpiDev* dev, uint32_t hz);
+
 /**
  * Allocate SPI bus for current task, but do not assert CS.
+ * Bus is reconfigured for device clock, mode and word size
+ * if they differ from previous user.
  */
 void    uosSpiBeginNoCS(UosSpiDev* dev);
 
 /**
  * Allocate SPI bus for current task and assert CS.
+ * Bus is reconfigured like in uosSpiBeginNoCS.
  */
 void    uosSpiBegin(UosSpiDev* dev);
 
@@ -220,6 +349,41 @@ void    uosSpiBegin(UosSpiDev* dev);
  */
 void    uosSpiCS(UosSpiDev* dev, bool select);
 
+#if defined(UOSCFG_SPI_STATIC_BUS) && DOX != 1
+
+/*
+ * Board has only one SPI bus. Header provides
+ * uosSpiStaticXchg, uosSpiStaticXmit and uosSpiStaticRcvr
+ * as static inline functions, which are called directly.
+ */
+#include UOSCFG_SPI_STATIC_BUS
+
+#if UOSCFG_SPI_STATS > 0
+#define UOS_SPI_STAT_BYTES(dev, n) ((dev)->stats.bytes += (n))
+#else
+#define UOS_SPI_STAT_BYTES(dev, n)
+#endif
+
+static inline uint8_t uosSpiXchg(UosSpiDev* dev, uint8_t data)
+{
+  UOS_SPI_STAT_BYTES(dev, 1);
+  return uosSpiStaticXchg(data);
+}
+
+static inline void uosSpiXmit(UosSpiDev* dev, const uint8_t* data, int len)
+{
+  UOS_SPI_STAT_BYTES(dev, len);
+  uosSpiStaticXmit(data, len);
+}
+
+static inline void uosSpiRcvr(UosSpiDev* dev, uint8_t* data, int len)
+{
+  UOS_SPI_STAT_BYTES(dev, len);
+  uosSpiStaticRcvr(data, len);
+}
+
+#else
+
 /**
  * Exchange byte on SPI bus.
  */
@@ -235,12 +399,109 @@ void    uosSpiXmit(UosSpiDev* dev, const uint8_t* data, int len);
  */
 void    uosSpiRcvr(UosSpiDev* dev, uint8_t* data, int len);
 
+#endif
+
+/**
+ * Transmit multiple segments of data as one transfer.
+ */
+void    uosSpiXmitV(UosSpiDev* dev, const UosSpiXmitSeg* seg, int cnt);
+
+/**
+ * Receive data into multiple segments as one transfer.
+ */
+void    uosSpiRcvrV(UosSpiDev* dev, const UosSpiRcvrSeg* seg, int cnt);
+
+/**
+ * Transmit and receive multiple bytes at the same time.
+ * Either tx or rx can be NULL, in which case this works like
+ * uosSpiRcvr or uosSpiXmit. If both are NULL, this works
+ * like uosSpiSkip.
+ */
+void    uosSpiTransfer(UosSpiDev* dev, const uint8_t* tx, uint8_t* rx, int len);
+
+/**
+ * Transmit same byte multiple times, discarding received data.
+ */
+void    uosSpiFill(UosSpiDev* dev, uint8_t pattern, int len);
+
+/**
+ * Clock multiple bytes without transmitting or receiving
+ * anything useful (transmits 0xff).
+ */
+void    uosSpiSkip(UosSpiDev* dev, int len);
+
 /**
  * Free SPI bus from current task. If chip select was turned
  * low by uosSpiBegin, turn it high again.
  */
 void    uosSpiEnd(UosSpiDev* dev);
 
+#if UOSCFG_SPI_RESERVE > 0 || DOX == 1
+
+/**
+ * Reserve SPI bus for a burst of uosSpiBegin/uosSpiEnd cycles
+ * by current task. Reservation ends after count cycles or when
+ * ticks have passed, whichever comes first. Zero means no limit.
+ * Both limits are checked only by uosSpiEnd of reserving task,
+ * so time limit cannot end reservation of a task that is not
+ * using the bus. Other tasks and queued transactions get the bus
+ * only between bursts.
+ */
+void    uosSpiReserve(UosSpiDev* dev, int count, JIF_t ticks);
+
+/**
+ * End bus reservation before its limits are reached.
+ */
+void    uosSpiRelease(UosSpiDev* dev);
+
+#endif
+
+#if UOSCFG_SPI_QUEUE > 0 || DOX == 1
+
+/**
+ * Queue transaction for bus worker task. Transactions are
+ * run in priority order, between them bus is available also
+ * for uosSpiBegin/uosSpiEnd users. Reserved bus is not taken
+ * until the burst is over, if submitting task has reserved
+ * the bus transaction is run immediately instead. Worker runs
+ * at priority of highest submitting task with queued
+ * transactions (requires POSCFG_FEATURE_GETTASK,
+ * POSCFG_FEATURE_GETPRIORITY and POSCFG_FEATURE_SETPRIORITY).
+ * Must not be called between uosSpiBegin and uosSpiEnd.
+ * Transaction must stay valid until it is complete.
+ */
+void    uosSpiSubmit(UosSpiDev* dev, UosSpiTransaction* t);
+
+#endif
+
+#if UOSCFG_SPI_STATS > 0 || DOX == 1
+
+/**
+ * Get bus usage statistics of device, optionally
+ * resetting them.
+ */
+void    uosSpiGetStats(UosSpiDev* dev, UosSpiStats* st, bool reset);
+
+/**
+ * Print bus usage statistics of all devices. Called
+ * by uosResourceDiag.
+ */
+void    uosSpiDiag(void);
+
+#endif
+
+/**
+ * Service interrupt-driven transfer. Called by
+ * port SPI interrupt handler.
+ */
+void    uosSpiFifoIsr(UosSpiBus* bus);
+
+/**
+ * Signal completion of transfer started by xmitAsync or
+ * rcvrAsync hook. Called by port, usually from DMA interrupt handler.
+ */
+void    uosSpiAsyncDone(const UosSpiBus* bus);
+
 /** @} */
 
 #endif
@@ -503,6 +764,29 @@ const UosDisk* uosGetDisk(int diskNumber);
  */
 int uosMountFat(const char* mountPoint, int diskNumber);
 
+/**
+ * Option for uosFormatFat: create volume without partition table
+ * (super-floppy disk).
+ */
+#define UOS_FAT_FORMAT_SFD       0x01
+
+/**
+ * Option for uosFormatFat: workload consists mostly of large files
+ * that are written and read sequentially, so use largest cluster size
+ * that gives valid FAT type for the volume.
+ */
+#define UOS_FAT_FORMAT_STREAMING 0x02
+
+/**
+ * Create a FAT filesystem on disk. Data area is aligned to
+ * erase block size reported by disk (GET_BLOCK_SIZE ioctl)
+ * and cluster size is selected so that clusters don't cross
+ * erase block boundaries. Options are UOS_FAT_FORMAT_* flags.
+ * There must not be any open files on the disk.
+ * Requires _USE_MKFS = 1.
+ */
+int uosFormatFat(int diskNumber, int options);
+
 #if UOSCFG_FAT_MMC > 0 || DOX == 1
 
 extern const UosDiskConf uosMmcDiskConf;
@@ -526,6 +810,34 @@ typedef struct uosMmcDisk {
   UosDisk base;
   const UosMmcSpiConf* cf;
   UosSpiDev* dev;
+  uint16_t busySpin;        // Polls before sleeping while card is busy, 0 = default
+  uint16_t busySleepMs;     // Max sleep between polls, 0 = default
+  uint32_t maxClock;        // Max SPI clock for card socket, 0 = default
+
+/*
+ * Card state, maintained by driver. Zero-initialized
+ * state means that card has not been initialized.
+ */
+  volatile uint8_t stat;    // STA_NODISK and STA_PROTECT bits
+  uint8_t cardType;         // CT_* flags, 0 if card is not initialized
+  uint8_t csd[16];
+  uint8_t cid[16];
+  uint32_t sectorCount;
+  uint32_t eraseBlock;      // Erase block size in sectors, 1 if unknown
+  uint8_t speedClass;       // SD speed class, 0 if unknown
+  uint32_t clock;           // Negotiated SPI clock, 0 if unknown
+  bool wrStream;            // Multiple block write is open
+  uint32_t wrNext;          // Next sector of open write
+  JIF_t wrIdle;             // Idle timeout of open write
+  bool rdStream;            // Multiple block read is open
+  uint32_t rdNext;          // Next sector of open read
+  JIF_t rdIdle;             // Idle timeout of open read
+#if UOSCFG_FAT_MMC_STAGE > 0
+  uint8_t* stageBuf;        // Write staging buffer
+  uint32_t stageSize;       // Staging window in sectors, 0 if not in use
+  uint32_t stageFirst;      // Staged sectors
+  uint32_t stageEnd;
+#endif
 } UosMmcDisk;
 
 /**
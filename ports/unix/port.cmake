@@ -0,0 +1,7 @@
+include_guard(GLOBAL)
+
+set(FILES_PORT
+    ports/${PORT}/u_spin.c
+    ports/${PORT}/u_sdsim.c)
+
+set(PORT_INCLUDES ${CMAKE_CURRENT_LIST_DIR})
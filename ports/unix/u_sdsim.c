@@ -0,0 +1,637 @@
+/*
+ * Copyright (c) 2016, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated SDHC card on SPI bus. Card contents are kept
+ * either in memory or in image file. Simulator implements
+ * enough of SD SPI protocol for fsfatmmc.c driver:
+ * initialization, CSD/CID/SD status, single and multiple block
+ * transfers, CRC checking, read latency, write busy time and
+ * injected errors.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include "u_sdsim.h"
+
+#if UOSCFG_SPI_SDSIM > 0
+
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Simulator from its bus. Bus hooks that get const bus
+ * reach writable simulator through self pointer.
+ */
+#define SIM(b) (((const UosSdSim*)((const char*)(b) - offsetof(UosSdSim, bus)))->self)
+
+enum {
+  SIM_CMD,          // Waiting for command
+  SIM_READ,         // Sending data blocks
+  SIM_WRITE,        // Waiting for data token
+  SIM_WRITE_DATA    // Receiving data block
+};
+
+static void simInit(UosSpiBus* bus);
+static void simControl(UosSpiBus* bus, bool fullSpeed);
+static uint32_t simSetClock(UosSpiBus* bus, uint32_t hz);
+static void simCS(UosSpiBus* bus, bool select);
+static uint8_t simXchg(const UosSpiBus* bus, uint8_t data);
+
+const UosSpiBusConf uosSdSimConf = {
+
+  .init     = simInit,
+  .control  = simControl,
+  .setClock = simSetClock,
+  .cs       = simCS,
+  .xchg     = simXchg
+};
+
+/*
+ * Bitwise CRCs, intentionally independent of
+ * table-driven ones in driver.
+ */
+static uint8_t simCrc7(const uint8_t* p, int len)
+{
+  uint8_t crc = 0;
+  int i;
+
+  while (len--) {
+
+    crc ^= *p++;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x12 : crc << 1;
+  }
+
+  return crc | 1;
+}
+
+static uint16_t simCrc16(const uint8_t* p, int len)
+{
+  uint16_t crc = 0;
+  int i;
+
+  while (len--) {
+
+    crc ^= *p++ << 8;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+
+  return crc;
+}
+
+static uint64_t nowUs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void busyFor(UosSdSim* sim, uint32_t us, uint8_t waitByte)
+{
+  sim->readyAt = nowUs() + us;
+  sim->waitByte = waitByte;
+}
+
+static bool readSector(UosSdSim* sim, uint32_t sector, uint8_t* buf)
+{
+  if (sim->image) {
+
+    memcpy(buf, sim->image + sector * 512, 512);
+    return true;
+  }
+
+  return pread(sim->fd, buf, 512, (off_t)sector * 512) == 512;
+}
+
+static bool writeSector(UosSdSim* sim, uint32_t sector, const uint8_t* buf)
+{
+  if (sim->image) {
+
+    memcpy(sim->image + sector * 512, buf, 512);
+    return true;
+  }
+
+  return pwrite(sim->fd, buf, 512, (off_t)sector * 512) == 512;
+}
+
+static inline void queue(UosSdSim* sim, uint8_t b)
+{
+  sim->out[sim->outLen++] = b;
+}
+
+/*
+ * Queue data block with token and CRC.
+ */
+static void queueBlock(UosSdSim* sim, const uint8_t* data, int len)
+{
+  uint16_t crc = simCrc16(data, len);
+
+  queue(sim, 0xFE);
+  memcpy(sim->out + sim->outLen, data, len);
+  sim->outLen += len;
+  queue(sim, crc >> 8);
+  queue(sim, crc);
+}
+
+/*
+ * Queue R1 response, preceded by one byte of response time.
+ */
+static void respond(UosSdSim* sim, uint8_t r1)
+{
+  queue(sim, 0xFF);
+  queue(sim, r1 | (sim->idle ? 0x01 : 0x00));
+}
+
+static void buildCsd(UosSdSim* sim, uint8_t* csd)
+{
+  uint32_t cSize = sim->sectors / 1024 - 1;
+
+  memset(csd, 0, 16);
+  csd[0]  = 0x40;                             // CSD version 2.0
+  csd[1]  = 0x0E;                             // TAAC
+  csd[3]  = sim->highSpeed ? 0x5A : 0x32;     // TRAN_SPEED 50 or 25 MHz
+  csd[4]  = 0x5B;                             // CCC
+  csd[5]  = 0x59;                             // CCC, READ_BL_LEN = 9
+  csd[7]  = (cSize >> 16) & 0x3F;
+  csd[8]  = cSize >> 8;
+  csd[9]  = cSize;
+  csd[10] = 0x7F;                             // ERASE_BLK_EN, SECTOR_SIZE
+  csd[11] = 0x80;
+  csd[12] = 0x0A;                             // R2W_FACTOR, WRITE_BL_LEN = 9
+  csd[13] = 0x40;
+  csd[15] = simCrc7(csd, 15);
+}
+
+static void buildCid(uint8_t* cid)
+{
+  static const uint8_t data[15] = { 0x00, 'P', 'O', 'S', 'I', 'M', 'S', 'D',
+                                    0x10, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01 };
+
+  memcpy(cid, data, 15);
+  cid[15] = simCrc7(cid, 15);
+}
+
+static void appCommand(UosSdSim* sim, uint8_t cmd, uint32_t arg)
+{
+  uint8_t st[64];
+
+  switch (cmd) {
+  case 41:  // SD_SEND_OP_COND
+    if (sim->initPolls)
+      --sim->initPolls;
+    else
+      sim->idle = false;
+
+    respond(sim, 0);
+    break;
+
+  case 13:  // SD_STATUS
+    if (sim->idle) {
+
+      respond(sim, 0x04);
+      break;
+    }
+
+    memset(st, 0, sizeof(st));
+    st[8] = 0x04;         // Speed class 10
+    st[10] = 0x90;        // AU size 4 MB
+
+    respond(sim, 0);
+    queue(sim, 0x00);     // Second byte of R2
+    memcpy(sim->reg, st, 64);
+    sim->regLen = 64;
+    sim->state = SIM_READ;
+    break;
+
+  case 23:  // SET_WR_BLK_ERASE_COUNT, only recorded
+    sim->preErase = arg;
+    respond(sim, sim->idle ? 0x04 : 0);
+    break;
+
+  default:
+    respond(sim, 0x04);
+    break;
+  }
+}
+
+static void command(UosSdSim* sim)
+{
+  uint8_t cmd = sim->frame[0] & 0x3F;
+  uint32_t arg = ((uint32_t)sim->frame[1] << 24) | ((uint32_t)sim->frame[2] << 16) |
+                 ((uint32_t)sim->frame[3] << 8) | sim->frame[4];
+  bool app = sim->appCmd;
+
+  sim->appCmd = false;
+  sim->outLen = sim->outPos = 0;
+  sim->readyAt = 0;
+
+  if (sim->state == SIM_READ) {
+
+    if (cmd != 12)        // Only STOP_TRANSMISSION is accepted while sending data
+      return;
+
+    sim->state = SIM_CMD;
+    sim->pending = false;
+    sim->regLen = 0;
+    queue(sim, 0xFF);     // Stuff byte
+    queue(sim, 0x00);
+    return;
+  }
+
+  if (cmd == sim->crcErrorCmd) {
+
+    sim->crcErrorCmd = -1;
+    respond(sim, 0x08);   // Injected command CRC error
+    return;
+  }
+
+  if ((sim->crcOn || cmd == 0 || cmd == 8) && simCrc7(sim->frame, 5) != sim->frame[5]) {
+
+    respond(sim, 0x08);   // Command CRC error
+    return;
+  }
+
+  if (app) {
+
+    appCommand(sim, cmd, arg);
+    return;
+  }
+
+  if (sim->idle && cmd != 0 && cmd != 8 && cmd != 55 && cmd != 58 && cmd != 59) {
+
+    respond(sim, 0x04);   // Illegal command in idle state
+    return;
+  }
+
+  switch (cmd) {
+  case 0:   // GO_IDLE_STATE
+    sim->idle = true;
+    sim->crcOn = false;
+    sim->highSpeed = false;
+    sim->initPolls = 2;
+    respond(sim, 0);
+    break;
+
+  case 8:   // SEND_IF_COND
+    respond(sim, 0);
+    queue(sim, 0x00);
+    queue(sim, 0x00);
+    queue(sim, (arg >> 8) & 0x0F);
+    queue(sim, arg);
+    break;
+
+  case 55:  // APP_CMD
+    sim->appCmd = true;
+    respond(sim, 0);
+    break;
+
+  case 58:  // READ_OCR
+    respond(sim, 0);
+    queue(sim, sim->idle ? 0x40 : 0xC0);  // Power up status, CCS
+    queue(sim, 0xFF);
+    queue(sim, 0x80);
+    queue(sim, 0x00);
+    break;
+
+  case 59:  // CRC_ON_OFF
+    sim->crcOn = arg & 1;
+    respond(sim, 0);
+    break;
+
+  case 6:   // SWITCH_FUNC, only high speed of group 1 is supported
+    memset(sim->reg, 0, 64);
+    sim->reg[13] = 0x03;
+    sim->reg[16] = ((arg & 0x0F) <= 1) ? (arg & 0x0F) : 0x0F;
+    if ((arg & 0x80000000) && (arg & 0x0F) == 1)
+      sim->highSpeed = true;
+
+    respond(sim, 0);
+    sim->regLen = 64;
+    sim->state = SIM_READ;
+    break;
+
+  case 9:   // SEND_CSD
+    buildCsd(sim, sim->reg);
+    respond(sim, 0);
+    sim->regLen = 16;
+    sim->state = SIM_READ;
+    break;
+
+  case 10:  // SEND_CID
+    buildCid(sim->reg);
+    respond(sim, 0);
+    sim->regLen = 16;
+    sim->state = SIM_READ;
+    break;
+
+  case 12:  // STOP_TRANSMISSION when nothing is going on
+    queue(sim, 0xFF);
+    queue(sim, 0x00);
+    break;
+
+  case 16:  // SET_BLOCKLEN
+    respond(sim, arg == 512 ? 0 : 0x40);
+    break;
+
+  case 17:  // READ_SINGLE_BLOCK
+  case 18:  // READ_MULTIPLE_BLOCK
+    if (arg >= sim->sectors) {
+
+      respond(sim, 0x40);
+      break;
+    }
+
+    respond(sim, 0);
+    sim->sector = arg;
+    sim->multi = (cmd == 18);
+    sim->pending = false;
+    sim->state = SIM_READ;
+    break;
+
+  case 24:  // WRITE_BLOCK
+  case 25:  // WRITE_MULTIPLE_BLOCK
+    if (arg >= sim->sectors) {
+
+      respond(sim, 0x40);
+      break;
+    }
+
+    respond(sim, 0);
+    sim->sector = arg;
+    sim->multi = (cmd == 25);
+    sim->state = SIM_WRITE;
+    break;
+
+  default:
+    respond(sim, 0x04);
+    break;
+  }
+}
+
+/*
+ * Load next data block into output queue.
+ */
+static void loadBlock(UosSdSim* sim)
+{
+  uint8_t buf[512];
+
+  sim->outLen = sim->outPos = 0;
+  if (sim->regLen) {
+
+    queueBlock(sim, sim->reg, sim->regLen);
+    sim->regLen = 0;
+    sim->state = SIM_CMD;
+    return;
+  }
+
+  if (sim->sector >= sim->sectors) {
+
+    queue(sim, 0x08);       // Error token: out of range
+    sim->state = SIM_CMD;
+    return;
+  }
+
+  if (sim->sector == sim->badSector || !readSector(sim, sim->sector, buf)) {
+
+    queue(sim, 0x01);       // Error token: error
+    sim->state = SIM_CMD;
+    return;
+  }
+
+  queueBlock(sim, buf, 512);
+  if (sim->crcErrorBlocks) {
+
+    --sim->crcErrorBlocks;
+    sim->out[sim->outLen - 1] ^= 0xFF;  // Injected data CRC error
+  }
+
+  sim->sector++;
+  ++sim->blocksRead;
+  if (!sim->multi)
+    sim->state = SIM_CMD;
+}
+
+/*
+ * Byte that card sends during next clock cycle.
+ */
+static uint8_t nextOut(UosSdSim* sim)
+{
+  if (sim->outPos < sim->outLen)
+    return sim->out[sim->outPos++];
+
+  if (sim->readyAt && nowUs() < sim->readyAt)
+    return sim->waitByte;
+
+  sim->readyAt = 0;
+  if (sim->state == SIM_READ) {
+
+    if (!sim->regLen && !sim->pending) { // Access time before each data block
+
+      sim->pending = true;
+      busyFor(sim, sim->readLatencyUs, 0xFF);
+      return 0xFF;
+    }
+
+    sim->pending = false;
+    loadBlock(sim);
+    return sim->out[sim->outPos++];
+  }
+
+  return 0xFF;
+}
+
+/*
+ * Process byte that card received from host.
+ */
+static void processIn(UosSdSim* sim, uint8_t in)
+{
+  uint8_t resp;
+  uint16_t crc;
+
+  switch (sim->state) {
+  case SIM_CMD:
+  case SIM_READ:
+    if (sim->framePos == 0 && (in & 0xC0) != 0x40)
+      break;
+
+    sim->frame[sim->framePos++] = in;
+    if (sim->framePos == 6) {
+
+      sim->framePos = 0;
+      command(sim);
+    }
+
+    break;
+
+  case SIM_WRITE:
+    if (sim->readyAt || sim->outPos < sim->outLen)
+      break;                          // Busy or still responding
+
+    if (in == (sim->multi ? 0xFC : 0xFE)) {
+
+      sim->dataPos = 0;
+      sim->state = SIM_WRITE_DATA;
+    }
+    else if (in == 0xFD && sim->multi) {
+
+      sim->state = SIM_CMD;
+      sim->outLen = sim->outPos = 0;
+      queue(sim, 0xFF);
+      busyFor(sim, sim->writeBusyUs / 4, 0x00);
+    }
+
+    break;
+
+  case SIM_WRITE_DATA:
+    sim->data[sim->dataPos++] = in;
+    if (sim->dataPos < 514)
+      break;
+
+    crc = (sim->data[512] << 8) | sim->data[513];
+    if (sim->crcOn && crc != simCrc16(sim->data, 512))
+      resp = 0x0B;                    // Data rejected due to CRC error
+    else if (sim->sector >= sim->sectors ||
+             sim->sector == sim->badSector ||
+             !writeSector(sim, sim->sector, sim->data))
+      resp = 0x0D;                    // Data rejected due to write error
+    else {
+
+      resp = 0x05;                    // Data accepted
+      sim->sector++;
+      ++sim->blocksWritten;
+    }
+
+    sim->outLen = sim->outPos = 0;
+    queue(sim, resp);
+    busyFor(sim, sim->writeBusyUs, 0x00);
+    sim->state = sim->multi ? SIM_WRITE : SIM_CMD;
+    break;
+  }
+}
+
+static void simInit(UosSpiBus* bus)
+{
+  UosSdSim* sim = SIM(bus);
+
+  sim->state = SIM_CMD;
+  sim->idle = true;
+  sim->selected = false;
+  sim->appCmd = false;
+  sim->crcOn = false;
+  sim->highSpeed = false;
+  sim->pending = false;
+  sim->regLen = 0;
+  sim->framePos = 0;
+  sim->outLen = sim->outPos = 0;
+  sim->readyAt = 0;
+}
+
+static void simControl(UosSpiBus* bus, bool fullSpeed)
+{
+  UosSdSim* sim = SIM(bus);
+
+  sim->clock = fullSpeed ? 25000000 : 400000;
+}
+
+static uint32_t simSetClock(UosSpiBus* bus, uint32_t hz)
+{
+  UosSdSim* sim = SIM(bus);
+
+  sim->clock = hz;
+  return hz;
+}
+
+static void simCS(UosSpiBus* bus, bool select)
+{
+  UosSdSim* sim = SIM(bus);
+
+  sim->selected = select;
+}
+
+static uint8_t simXchg(const UosSpiBus* bus, uint8_t data)
+{
+  UosSdSim* sim = SIM(bus);
+  uint8_t out;
+
+  if (!sim->selected || sim->removed)
+    return 0xFF;
+
+  out = nextOut(sim);
+  processIn(sim, data);
+  return out;
+}
+
+int uosSdSimInit(UosSdSim* sim, uint8_t* image, uint32_t sectors)
+{
+  if (sectors < 1024) {
+
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(sim, '\0', sizeof(UosSdSim));
+  sim->self = sim;
+  sim->image = image;
+  sim->fd = -1;
+  sim->sectors = sectors & ~1023;
+  sim->badSector = UOS_SDSIM_NONE;
+  sim->crcErrorCmd = -1;
+  uosSpiInit(&sim->bus, &uosSdSimConf);
+  return 0;
+}
+
+int uosSdSimOpen(UosSdSim* sim, const char* fileName)
+{
+  struct stat st;
+  int fd;
+
+  fd = open(fileName, O_RDWR);
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) == -1 || uosSdSimInit(sim, NULL, st.st_size / 512) == -1) {
+
+    close(fd);
+    return -1;
+  }
+
+  sim->fd = fd;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2016, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _U_SDSIM_H
+#define _U_SDSIM_H
+
+#include <picoos-u.h>
+
+#if UOSCFG_SPI_SDSIM > 0 || DOX == 1
+
+/**
+ * No sector selected for error injection.
+ */
+#define UOS_SDSIM_NONE 0xFFFFFFFF
+
+/**
+ * Simulated SDHC card on SPI bus (unix port). Card contents are
+ * either in memory or in image file. Latency, error injection
+ * and removed fields can be changed at any time after uosSdSimInit
+ * to exercise timeout and error handling of MMC driver.
+ */
+typedef struct uosSdSim {
+
+  UosSpiBus bus;
+  struct uosSdSim* self;    // For bus hooks that get const bus
+  uint8_t* image;           // Memory image, NULL if file is used
+  int fd;                   // Image file
+  uint32_t sectors;
+  uint32_t readLatencyUs;   // Delay before each data block
+  uint32_t writeBusyUs;     // Busy time after each written block
+  uint32_t badSector;       // Sector that fails to read or write, UOS_SDSIM_NONE if none
+  int8_t crcErrorCmd;       // Command that fails once with CRC error, -1 if none
+  uint16_t crcErrorBlocks;  // Number of next data blocks sent with bad CRC
+  bool removed;             // Card does not respond at all
+  uint32_t clock;           // Clock rate set by driver
+  uint32_t blocksRead;
+  uint32_t blocksWritten;
+  uint32_t preErase;        // Block count of last ACMD23
+
+/*
+ * Card protocol state.
+ */
+  uint8_t state;
+  bool selected;
+  bool idle;
+  bool appCmd;
+  bool crcOn;
+  bool highSpeed;
+  bool multi;
+  bool pending;
+  uint8_t initPolls;
+  uint8_t waitByte;
+  uint64_t readyAt;
+  uint32_t sector;
+  uint8_t frame[6];
+  int framePos;
+  uint8_t reg[64];
+  int regLen;
+  uint8_t out[520];
+  int outLen;
+  int outPos;
+  uint8_t data[514];
+  int dataPos;
+} UosSdSim;
+
+extern const UosSpiBusConf uosSdSimConf;
+
+/**
+ * Initialize simulated card using memory image. All fields
+ * are reset first. Number of sectors is rounded down to
+ * multiple of 1024. Initializes also SPI bus of card.
+ */
+int uosSdSimInit(UosSdSim* sim, uint8_t* image, uint32_t sectors);
+
+/**
+ * Initialize simulated card using image file.
+ */
+int uosSdSimOpen(UosSdSim* sim, const char* fileName);
+
+#endif
+
+#endif
@@ -30,31 +30,214 @@
 
 #include <picoos.h>
 #include <picoos-u.h>
+#include <string.h>
 
 #if UOSCFG_SPI_BUS > 0
 
+#if UOSCFG_SPI_RESERVE > 0 && POSCFG_FEATURE_GETTASK != 1
+#error UOSCFG_SPI_RESERVE requires POSCFG_FEATURE_GETTASK
+#endif
+
+#ifndef UOSCFG_SPI_ASYNC_MIN
+#define UOSCFG_SPI_ASYNC_MIN 32
+#endif
+
+/*
+ * Buffer size for FIFO fill with pattern other than 0xff.
+ */
+#define FIFO_CHUNK 64
+
+#if UOSCFG_SPI_STATS > 0
+
+#ifndef UOSCFG_SPI_STATS_TIME
+#define UOSCFG_SPI_STATS_TIME() ((uint32_t)jiffies)
+#endif
+
+#define STAT_BYTES(dev, n) ((dev)->stats.bytes += (n))
+
+static UosSpiDev* devList;
+
+#else
+
+#define STAT_BYTES(dev, n)
+
+#endif
+
+#if UOSCFG_SPI_QUEUE > 0
+
+#ifndef UOSCFG_SPI_QUEUE_PRIO
+#define UOSCFG_SPI_QUEUE_PRIO 4
+#endif
+
+/*
+ * Queue worker inherits priority of submitting tasks
+ * if their priorities can be queried and changed.
+ */
+#if POSCFG_FEATURE_GETTASK == 1 && POSCFG_FEATURE_GETPRIORITY == 1 && POSCFG_FEATURE_SETPRIORITY == 1
+#define QUEUE_INHERIT 1
+#else
+#define QUEUE_INHERIT 0
+#endif
+
+static void queueWorker(void* arg);
+
+#endif
+
 /*
- * Default implementation for spi transmit.
+ * Exchange frames using port hooks. Uses wide frames if port
+ * has them, falls back to byte exchange. NULL tx sends fill
+ * byte and NULL rx discards received data.
  */
-static void defaultXmit(
+static void defaultFrames(
     const UosSpiBus* bus,
-    const uint8_t *p,
+    const uint8_t *tx,
+    uint8_t *rx,
+    uint8_t fill,
     int cnt)
 {
-  while (cnt--)
-    bus->cf->xchg(bus, *p++);
+  const UosSpiBusConf* cf = bus->cf;
+  uint32_t w;
+
+  if (cf->xchg32)
+    for (; cnt >= 4; cnt -= 4) {
+
+      if (tx) {
+
+        w = ((uint32_t)tx[0] << 24) | ((uint32_t)tx[1] << 16) | ((uint32_t)tx[2] << 8) | tx[3];
+        tx += 4;
+      }
+      else
+        w = fill * 0x01010101U;
+
+      w = cf->xchg32(bus, w);
+      if (rx) {
+
+        *rx++ = w >> 24;
+        *rx++ = w >> 16;
+        *rx++ = w >> 8;
+        *rx++ = w;
+      }
+    }
+
+  if (cf->xchg16)
+    for (; cnt >= 2; cnt -= 2) {
+
+      if (tx) {
+
+        w = (tx[0] << 8) | tx[1];
+        tx += 2;
+      }
+      else
+        w = fill * 0x0101U;
+
+      w = cf->xchg16(bus, w);
+      if (rx) {
+
+        *rx++ = w >> 8;
+        *rx++ = w;
+      }
+    }
+
+  while (cnt--) {
+
+    w = cf->xchg(bus, tx ? *tx++ : fill);
+    if (rx)
+      *rx++ = w;
+  }
 }
 
 /*
- * Default implementation for spi receive.
+ * Default implementation for spi transmit and receive. Uses
+ * transfer hook if port has it.
  */
-static void defaultRcvr(
+static void defaultTransfer(
     const UosSpiBus* bus,
-    uint8_t *p,
+    const uint8_t *tx,
+    uint8_t *rx,
     int cnt)
 {
-  while (cnt--)
-    *p++ = bus->cf->xchg(bus, 0xff);
+  if (bus->cf->transfer)
+    bus->cf->transfer(bus, tx, rx, cnt);
+  else
+    defaultFrames(bus, tx, rx, 0xff, cnt);
+}
+
+/*
+ * Fill transmit FIFO, but don't let more than FIFO depth
+ * bytes be in flight so that receive FIFO cannot overflow.
+ */
+static void fifoRefill(UosSpiBus* bus)
+{
+  int room = bus->cf->fifoDepth - (bus->fifoRxLeft - bus->fifoTxLeft);
+  int n;
+
+  if (room > bus->fifoTxLeft)
+    room = bus->fifoTxLeft;
+
+  if (room <= 0)
+    return;
+
+  n = bus->cf->fifoFill(bus, bus->fifoTx, room);
+  if (bus->fifoTx)
+    bus->fifoTx += n;
+
+  bus->fifoTxLeft -= n;
+}
+
+/*
+ * Interrupt-driven transfer using port FIFO callbacks. Task
+ * sleeps until transfer is complete.
+ */
+static void fifoTransfer(
+    UosSpiBus* bus,
+    const uint8_t *tx,
+    uint8_t *rx,
+    int cnt)
+{
+  bus->fifoTx = tx;
+  bus->fifoRx = rx;
+  bus->fifoTxLeft = cnt;
+  bus->fifoRxLeft = cnt;
+
+  fifoRefill(bus);
+  bus->cf->fifoIrq(bus, true);
+  nosSemaWait(bus->asyncDone, INFINITE);
+}
+
+/*
+ * FIFO transfer of repeated byte. NULL tx can only
+ * send 0xff, other patterns are sent from small buffer.
+ */
+static void fifoPattern(UosSpiBus* bus, uint8_t pattern, int cnt)
+{
+  uint8_t chunk[FIFO_CHUNK];
+  int n;
+
+  memset(chunk, pattern, sizeof(chunk));
+  for (; cnt > 0; cnt -= n) {
+
+    n = cnt < (int)sizeof(chunk) ? cnt : (int)sizeof(chunk);
+    fifoTransfer(bus, chunk, NULL, n);
+  }
+}
+
+void uosSpiFifoIsr(UosSpiBus* bus)
+{
+  int n;
+
+  n = bus->cf->fifoDrain(bus, bus->fifoRx, bus->fifoRxLeft);
+  if (bus->fifoRx)
+    bus->fifoRx += n;
+
+  bus->fifoRxLeft -= n;
+  if (bus->fifoRxLeft == 0) {
+
+    bus->cf->fifoIrq(bus, false);
+    posSemaSignal(bus->asyncDone);
+    return;
+  }
+
+  fifoRefill(bus);
 }
 
 void uosSpiInit(UosSpiBus* bus, const UosSpiBusConf* cf)
@@ -63,22 +246,108 @@ void uosSpiInit(UosSpiBus* bus, const UosSpiBusConf* cf)
   bus->busMutex = nosMutexCreate(0, "spi*");
   bus->currentDev = NULL;
   bus->active = false;
+  bus->asyncDone = NULL;
+  bus->clock = 0;
+  bus->mode = 0xff;               // Unknown, first user sets it
+  bus->wordSize = 0;
+#if UOSCFG_SPI_RESERVE > 0
+  bus->burstDev = NULL;
+  bus->burstTask = NULL;
+#endif
+  if (cf->xmitAsync || cf->rcvrAsync || cf->fifoFill)
+    bus->asyncDone = nosSemaCreate(0, 0, "spi*");
+
   bus->cf->init(bus);
+
+#if UOSCFG_SPI_QUEUE > 0
+  bus->queue = NULL;
+  bus->queueSema = nosSemaCreate(0, 0, "spiq*");
+  P_ASSERT("uosSpiInit", bus->queueSema != NULL);
+
+  bus->queuePrio = UOSCFG_SPI_QUEUE_PRIO;
+  bus->queueTask = nosTaskCreate(queueWorker, bus, UOSCFG_SPI_QUEUE_PRIO, 0, "spiq");
+  P_ASSERT("uosSpiInit", bus->queueTask != NULL);
+#endif
 }
 
 void uosSpiControl(UosSpiBus* bus, bool fullSpeed)
 {
   P_ASSERT("uosSpiControl", bus->active);
   P_ASSERT("uosSpiControl", bus->cf->control != NULL);
+  bus->clock = 0;                 // Not known anymore
   bus->cf->control(bus, fullSpeed);
 }
 
+uint32_t uosSpiSetClock(UosSpiDev* dev, uint32_t hz)
+{
+  UosSpiBus* bus = dev->bus;
+  P_ASSERT("uosSpiSetClock", bus->active);
+
+  dev->clock = hz;
+  bus->clock = hz;
+  if (bus->cf->setClock)
+    return bus->cf->setClock(bus, hz);
+
+/*
+ * Port knows only slow (card initialization) and full speed.
+ */
+  P_ASSERT("uosSpiSetClock", bus->cf->control != NULL);
+  bus->cf->control(bus, hz > 400000);
+  return 0;
+}
+
+/*
+ * Switch bus to device profile. Peripheral is touched
+ * only if something differs from previous device.
+ */
+static void applyProfile(UosSpiBus* bus, UosSpiDev* dev)
+{
+  const UosSpiDevConf* cf = dev->cf;
+
+  if (dev->clock && dev->clock != bus->clock) {
+
+    bus->clock = dev->clock;
+    if (bus->cf->setClock)
+      bus->cf->setClock(bus, dev->clock);
+    else if (bus->cf->control)
+      bus->cf->control(bus, dev->clock > 400000);
+  }
+
+  if (bus->cf->setFormat && (cf->mode != bus->mode || cf->wordSize != bus->wordSize)) {
+
+    bus->mode = cf->mode;
+    bus->wordSize = cf->wordSize;
+    bus->cf->setFormat(bus, cf->mode, cf->wordSize ? cf->wordSize : 8);
+  }
+}
+
+/*
+ * Lock bus for device, recording time waited.
+ */
+static void lockBus(UosSpiBus* bus, UosSpiDev* dev)
+{
+#if UOSCFG_SPI_STATS > 0
+  uint32_t start = UOSCFG_SPI_STATS_TIME();
+  uint32_t wait;
+
+  nosMutexLock(bus->busMutex);
+
+  dev->holdStart = UOSCFG_SPI_STATS_TIME();
+  wait = dev->holdStart - start;
+  if (wait > dev->stats.waitMax)
+    dev->stats.waitMax = wait;
+#else
+  nosMutexLock(bus->busMutex);
+#endif
+}
+
 void uosSpiBeginNoCS(UosSpiDev* dev)
 {
   UosSpiBus* bus = dev->bus;
   P_ASSERT("uosSpiBegin", !bus->active);
 
-  nosMutexLock(bus->busMutex);
+  lockBus(bus, dev);
+  applyProfile(bus, dev);
   bus->currentDev = NULL;
   bus->active = true;
 }
@@ -88,7 +357,8 @@ void uosSpiBegin(UosSpiDev* dev)
   UosSpiBus* bus = dev->bus;
   P_ASSERT("uosSpiBegin", !bus->active);
 
-  nosMutexLock(bus->busMutex);
+  lockBus(bus, dev);
+  applyProfile(bus, dev);
   bus->currentDev = dev;
   bus->cf->cs(bus, true);
   bus->active = true;
@@ -103,10 +373,13 @@ void uosSpiCS(UosSpiDev* dev, bool select)
   bus->cf->cs(bus, select);
 }
 
+#ifndef UOSCFG_SPI_STATIC_BUS
+
 uint8_t uosSpiXchg(UosSpiDev* dev, uint8_t data)
 {
   UosSpiBus* bus = dev->bus;
   P_ASSERT("uosSpiXchg", bus->active);
+  STAT_BYTES(dev, 1);
 
   return bus->cf->xchg(bus, data);
 }
@@ -115,27 +388,141 @@ void uosSpiXmit(UosSpiDev* dev, const uint8_t* data, int len)
 {
   UosSpiBus* bus = dev->bus;
   P_ASSERT("uosSpiXmit", bus->active);
+  STAT_BYTES(dev, len);
+
+  if (bus->cf->xmitAsync &&
+      len >= UOSCFG_SPI_ASYNC_MIN &&
+      bus->cf->xmitAsync(bus, data, len)) {
 
-  if (bus->cf->xmit)
+    nosSemaWait(bus->asyncDone, INFINITE);
+    return;
+  }
+
+  if (bus->cf->fifoFill && len >= UOSCFG_SPI_ASYNC_MIN)
+    fifoTransfer(bus, data, NULL, len);
+  else if (bus->cf->xmit)
     bus->cf->xmit(bus, data, len);
   else
-    defaultXmit(bus, data, len);
+    defaultTransfer(bus, data, NULL, len);
 }
 
 void uosSpiRcvr(UosSpiDev* dev, uint8_t* data, int len)
 {
   UosSpiBus* bus = dev->bus;
   P_ASSERT("uosSpiRcvr", bus->active);
+  STAT_BYTES(dev, len);
+
+  if (bus->cf->rcvrAsync &&
+      len >= UOSCFG_SPI_ASYNC_MIN &&
+      bus->cf->rcvrAsync(bus, data, len)) {
 
-  if (bus->cf->rcvr)
+    nosSemaWait(bus->asyncDone, INFINITE);
+    return;
+  }
+
+  if (bus->cf->fifoFill && len >= UOSCFG_SPI_ASYNC_MIN)
+    fifoTransfer(bus, NULL, data, len);
+  else if (bus->cf->rcvr)
     bus->cf->rcvr(bus, data, len);
   else
-    defaultRcvr(bus, data, len);
+    defaultTransfer(bus, NULL, data, len);
+}
+
+#endif
+
+void uosSpiXmitV(UosSpiDev* dev, const UosSpiXmitSeg* seg, int cnt)
+{
+  UosSpiBus* bus = dev->bus;
+  P_ASSERT("uosSpiXmitV", bus->active);
+
+  if (bus->cf->xmitV) {
+
+#if UOSCFG_SPI_STATS > 0
+    int i;
+
+    for (i = 0; i < cnt; i++)
+      STAT_BYTES(dev, seg[i].len);
+#endif
+
+    bus->cf->xmitV(bus, seg, cnt);
+  }
+  else
+    for (; cnt > 0; --cnt, ++seg)
+      uosSpiXmit(dev, seg->data, seg->len);
+}
+
+void uosSpiRcvrV(UosSpiDev* dev, const UosSpiRcvrSeg* seg, int cnt)
+{
+  UosSpiBus* bus = dev->bus;
+  P_ASSERT("uosSpiRcvrV", bus->active);
+
+  if (bus->cf->rcvrV) {
+
+#if UOSCFG_SPI_STATS > 0
+    int i;
+
+    for (i = 0; i < cnt; i++)
+      STAT_BYTES(dev, seg[i].len);
+#endif
+
+    bus->cf->rcvrV(bus, seg, cnt);
+  }
+  else
+    for (; cnt > 0; --cnt, ++seg)
+      uosSpiRcvr(dev, seg->data, seg->len);
+}
+
+void uosSpiTransfer(UosSpiDev* dev, const uint8_t* tx, uint8_t* rx, int len)
+{
+  UosSpiBus* bus = dev->bus;
+  P_ASSERT("uosSpiTransfer", bus->active);
+
+  if (tx == NULL && rx == NULL)
+    uosSpiSkip(dev, len);
+  else if (tx == NULL)
+    uosSpiRcvr(dev, rx, len);
+  else if (rx == NULL)
+    uosSpiXmit(dev, tx, len);
+  else {
+
+    STAT_BYTES(dev, len);
+    if (bus->cf->fifoFill && len >= UOSCFG_SPI_ASYNC_MIN)
+      fifoTransfer(bus, tx, rx, len);
+    else
+      defaultTransfer(bus, tx, rx, len);
+  }
+}
+
+void uosSpiFill(UosSpiDev* dev, uint8_t pattern, int len)
+{
+  UosSpiBus* bus = dev->bus;
+  P_ASSERT("uosSpiFill", bus->active);
+  STAT_BYTES(dev, len);
+
+  if (bus->cf->fill)
+    bus->cf->fill(bus, pattern, len);
+  else if (bus->cf->fifoFill && len >= UOSCFG_SPI_ASYNC_MIN) {
+
+    if (pattern == 0xff)
+      fifoTransfer(bus, NULL, NULL, len);
+    else
+      fifoPattern(bus, pattern, len);
+  }
+  else
+    defaultFrames(bus, NULL, NULL, pattern, len);
+}
+
+void uosSpiSkip(UosSpiDev* dev, int len)
+{
+  uosSpiFill(dev, 0xff, len);
 }
 
 void uosSpiEnd(UosSpiDev* dev)
 {
   UosSpiBus* bus = dev->bus;
+#if UOSCFG_SPI_STATS > 0
+  uint32_t hold;
+#endif
   P_ASSERT("uosSpiEnd", bus->active);
 
   if (bus->currentDev)
@@ -143,13 +530,256 @@ void uosSpiEnd(UosSpiDev* dev)
 
   bus->currentDev = NULL;
   bus->active = false;
+
+#if UOSCFG_SPI_STATS > 0
+  hold = UOSCFG_SPI_STATS_TIME() - dev->holdStart;
+
+  ++dev->stats.cycles;
+  dev->stats.holdTotal += hold;
+  if (hold > dev->stats.holdMax)
+    dev->stats.holdMax = hold;
+#endif
+
   nosMutexUnlock(bus->busMutex);
+
+#if UOSCFG_SPI_RESERVE > 0
+/*
+ * If this task has reserved the bus, its reservation
+ * still holds the mutex. Check if burst is over.
+ */
+  if (bus->burstTask == posTaskGetCurrent()) {
+
+    if ((bus->burstLeft > 0 && --bus->burstLeft == 0) ||
+        (bus->burstEnd != 0 && POS_TIMEAFTER(jiffies, bus->burstEnd)))
+      uosSpiRelease(bus->burstDev);
+  }
+#endif
+}
+
+#if UOSCFG_SPI_RESERVE > 0
+
+void uosSpiReserve(UosSpiDev* dev, int count, JIF_t ticks)
+{
+  UosSpiBus* bus = dev->bus;
+  P_ASSERT("uosSpiReserve", !bus->active);
+
+  lockBus(bus, dev);
+  P_ASSERT("uosSpiReserve", bus->burstDev == NULL);
+
+  bus->burstDev = dev;
+  bus->burstTask = posTaskGetCurrent();
+  bus->burstLeft = count;
+  bus->burstEnd = 0;
+  if (ticks != 0) {
+
+    bus->burstEnd = jiffies + ticks;
+    if (bus->burstEnd == 0)       // Zero means no time limit
+      bus->burstEnd = 1;
+  }
+}
+
+void uosSpiRelease(UosSpiDev* dev)
+{
+  UosSpiBus* bus = dev->bus;
+
+  P_ASSERT("uosSpiRelease", bus->burstDev == dev);
+  bus->burstDev = NULL;
+  bus->burstTask = NULL;
+  nosMutexUnlock(bus->busMutex);
+}
+
+#endif
+
+#if UOSCFG_SPI_QUEUE > 0
+
+static void runTransaction(UosSpiTransaction* t)
+{
+  UosSpiDev* dev = t->dev;
+
+  uosSpiBegin(dev);
+
+  if (t->tx || t->rx)
+    uosSpiTransfer(dev, t->tx, t->rx, t->len);
+  else
+    uosSpiSkip(dev, t->len);
+
+  uosSpiEnd(dev);
+
+  t->complete = true;
+  if (t->done != NULL)
+    nosSemaSignal(t->done);
+}
+
+void uosSpiSubmit(UosSpiDev* dev, UosSpiTransaction* t)
+{
+  UosSpiBus* bus = dev->bus;
+  UosSpiTransaction** ptr;
+
+  t->dev = dev;
+  t->complete = false;
+
+#if UOSCFG_SPI_RESERVE > 0
+/*
+ * Worker cannot get the bus before reservation
+ * of this task ends, run transaction here.
+ */
+  if (bus->burstTask == posTaskGetCurrent()) {
+
+    runTransaction(t);
+    return;
+  }
+#endif
+
+#if QUEUE_INHERIT
+  t->taskPrio = posTaskGetPriority(posTaskGetCurrent());
+#else
+  t->taskPrio = UOSCFG_SPI_QUEUE_PRIO;
+#endif
+
+/*
+ * Insert after transactions with same or higher priority.
+ */
+  posTaskSchedLock();
+
+  ptr = &bus->queue;
+  while (*ptr != NULL && (*ptr)->prio >= t->prio)
+    ptr = &(*ptr)->next;
+
+  t->next = *ptr;
+  *ptr = t;
+
+#if QUEUE_INHERIT
+  if (t->taskPrio > bus->queuePrio) {
+
+    bus->queuePrio = t->taskPrio;
+    posTaskSetPriority(bus->queueTask, bus->queuePrio);
+  }
+#endif
+
+  posTaskSchedUnlock();
+
+  nosSemaSignal(bus->queueSema);
+}
+
+static void queueWorker(void* arg)
+{
+  UosSpiBus* bus = (UosSpiBus*)arg;
+  UosSpiTransaction* t;
+#if QUEUE_INHERIT
+  UosSpiTransaction* q;
+  VAR_t prio;
+#endif
+
+  while (true) {
+
+    nosSemaWait(bus->queueSema, INFINITE);
+
+    posTaskSchedLock();
+
+    t = bus->queue;
+    bus->queue = t->next;
+
+    posTaskSchedUnlock();
+
+    runTransaction(t);
+
+#if QUEUE_INHERIT
+/*
+ * Drop back to priority of highest task
+ * that still has transactions queued.
+ */
+    posTaskSchedLock();
+
+    prio = UOSCFG_SPI_QUEUE_PRIO;
+    for (q = bus->queue; q != NULL; q = q->next)
+      if (q->taskPrio > prio)
+        prio = q->taskPrio;
+
+    if (prio != bus->queuePrio) {
+
+      bus->queuePrio = prio;
+      posTaskSetPriority(bus->queueTask, prio);
+    }
+
+    posTaskSchedUnlock();
+#endif
+  }
+}
+
+#endif
+
+void uosSpiAsyncDone(const UosSpiBus* bus)
+{
+  posSemaSignal(bus->asyncDone);
 }
 
 void uosSpiDevInit(UosSpiDev* dev, const UosSpiDevConf* cf, UosSpiBus* bus)
 {
+#if UOSCFG_SPI_STATS > 0
+  UosSpiDev* d;
+#endif
+
   dev->cf = cf;
   dev->bus = bus;
+  dev->clock = cf->clock;
+
+#if UOSCFG_SPI_STATS > 0
+  memset(&dev->stats, '\0', sizeof(dev->stats));
+
+/*
+ * Device can be initialized again, link it only once.
+ */
+  posTaskSchedLock();
+
+  d = devList;
+  while (d != NULL && d != dev)
+    d = d->next;
+
+  if (d == NULL) {
+
+    dev->next = devList;
+    devList = dev;
+  }
+
+  posTaskSchedUnlock();
+#endif
 }
 
+#if UOSCFG_SPI_STATS > 0
+
+void uosSpiGetStats(UosSpiDev* dev, UosSpiStats* st, bool reset)
+{
+  posTaskSchedLock();
+
+  *st = dev->stats;
+  if (reset)
+    memset(&dev->stats, '\0', sizeof(dev->stats));
+
+  posTaskSchedUnlock();
+}
+
+void uosSpiDiag()
+{
+#if NOSCFG_FEATURE_CONOUT == 1 && NOSCFG_FEATURE_PRINTF == 1
+  UosSpiDev* dev;
+  UosSpiStats st;
+
+  nosPrint("SPI devices:\n");
+
+  for (dev = devList; dev != NULL; dev = dev->next) {
+
+    uosSpiGetStats(dev, &st, false);
+    nosPrintf("  %s cycles %lu bytes %lu hold max %lu avg %lu wait max %lu\n",
+              dev->cf->name ? dev->cf->name : "?",
+              (unsigned long)st.cycles,
+              (unsigned long)st.bytes,
+              (unsigned long)st.holdMax,
+              (unsigned long)(st.cycles ? st.holdTotal / st.cycles : 0),
+              (unsigned long)st.waitMax);
+  }
+#endif
+}
+
+#endif
+
 #endif
@@ -0,0 +1,955 @@
+/*
+ * Copyright (c) 2016, Ari Suutari <ari@stonepile.fi>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *  3. The name of the author may not be used to endorse or promote
+ *     products derived from this software without specific prior written
+ *     permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT,  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Regression test for MMC/SD driver and FAT filesystem, run
+ * against simulated SD card of unix port. Exit status is nonzero if
+ * any check fails.
+ */
+
+#include <picoos.h>
+#include <picoos-u.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "u_sdsim.h"
+
+#define SECTORS 65536
+#define BIG_SECTORS 8388608
+
+#define CHECK(x) do { \
+  if (!(x)) { \
+    nosPrintf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+    ++failures; \
+  } \
+} while (0)
+
+static int failures;
+
+static uint8_t image[SECTORS * 512];
+static uint8_t data[32 * 512];
+static uint8_t buf[32 * 512];
+
+static UosSdSim sim;
+static UosSpiDev dev;
+static UosMmcDisk disk;
+
+static UosSdSim bigSim;
+static UosSpiDev bigDev;
+static UosMmcDisk bigDisk;
+
+static const UosSpiDevConf devConf = {
+
+  .name = "sdsim"
+};
+
+static void mmcOpen(const UosMmcDisk* d)
+{
+}
+
+/*
+ * Socket power off resets card.
+ */
+static void mmcClose(const UosMmcDisk* d)
+{
+  uosSdSimConf.init(d->dev->bus);
+}
+
+static const UosMmcSpiConf mmcConf = {
+
+  .open  = mmcOpen,
+  .close = mmcClose
+};
+
+static int diskRead(int sector, int count)
+{
+  return uosMmcDiskConf.read(&disk.base, buf, sector, count);
+}
+
+static int diskWrite(const uint8_t* src, int sector, int count)
+{
+  return uosMmcDiskConf.write(&disk.base, src, sector, count);
+}
+
+static int diskSync(void)
+{
+  return uosMmcDiskConf.ioctl(&disk.base, CTRL_SYNC, NULL);
+}
+
+static bool onCard(const uint8_t* src, int sector, int count)
+{
+  return memcmp(image + sector * 512, src, count * 512) == 0;
+}
+
+static bool inImage(const char* text, int len)
+{
+  int i;
+
+  for (i = 0; i + len <= (int)sizeof(image); i++)
+    if (memcmp(image + i, text, len) == 0)
+      return true;
+
+  return false;
+}
+
+static void testInit(void)
+{
+  DWORD dw;
+  BYTE b;
+
+  CHECK(!(uosMmcDiskConf.init(&disk.base) & STA_NOINIT));
+  CHECK(disk.cardType == (CT_SD2 | CT_BLOCK));
+  CHECK(disk.clock == 25000000);
+  CHECK(sim.crcOn);
+
+  CHECK(uosMmcDiskConf.ioctl(&disk.base, GET_SECTOR_COUNT, &dw) == RES_OK && dw == SECTORS);
+  CHECK(uosMmcDiskConf.ioctl(&disk.base, GET_BLOCK_SIZE, &dw) == RES_OK && dw == 8192);
+  CHECK(uosMmcDiskConf.ioctl(&disk.base, MMC_GET_SPEED_CLASS, &b) == RES_OK && b == 10);
+}
+
+static void testReadWrite(void)
+{
+  int i;
+
+  for (i = 0; i < (int)sizeof(data); i++)
+    data[i] = rand();
+
+  CHECK(diskRead(100, 8) == RES_OK && onCard(buf, 100, 8));
+  CHECK(diskRead(108, 8) == RES_OK && onCard(buf, 108, 8));
+  CHECK(diskRead(3, 1) == RES_OK && onCard(buf, 3, 1));
+  CHECK(!disk.rdStream);
+  CHECK(diskRead(4, 1) == RES_OK && onCard(buf, 4, 1));
+  CHECK(disk.rdStream);
+  CHECK(diskRead(5, 1) == RES_OK && onCard(buf, 5, 1));
+  CHECK(diskRead(77, 1) == RES_OK && onCard(buf, 77, 1));
+  CHECK(!disk.rdStream);
+
+/*
+ * Idle streams are closed by CTRL_IDLE after timeout.
+ */
+  CHECK(diskRead(100, 2) == RES_OK && disk.rdStream);
+  CHECK(uosMmcDiskConf.ioctl(&disk.base, CTRL_IDLE, NULL) == RES_OK && disk.rdStream);
+  posTaskSleep(MS(UOSCFG_FAT_MMC_STREAM_MS) + 1);
+  CHECK(uosMmcDiskConf.ioctl(&disk.base, CTRL_IDLE, NULL) == RES_OK && !disk.rdStream);
+  CHECK(diskRead(102, 1) == RES_OK && onCard(buf, 102, 1));
+
+/*
+ * Sequential writes into staging window, write crossing
+ * window and single sectors.
+ */
+  CHECK(diskWrite(data, 200, 8) == RES_OK);
+  CHECK(diskWrite(data + 8 * 512, 208, 8) == RES_OK);
+  sim.preErase = 0;
+  CHECK(diskWrite(data, 250, 20) == RES_OK && sim.preErase == 20);
+  CHECK(diskWrite(data + 31 * 512, 7, 1) == RES_OK);
+  CHECK(diskSync() == RES_OK);
+
+  CHECK(onCard(data, 200, 16));
+  CHECK(onCard(data, 250, 20));
+  CHECK(onCard(data + 31 * 512, 7, 1));
+
+  CHECK(diskRead(200, 32) == RES_OK && onCard(buf, 200, 32));
+
+/*
+ * Staged data must be visible to reads before sync.
+ */
+  CHECK(diskWrite(data, 400, 2) == RES_OK);
+  CHECK(diskRead(399, 4) == RES_OK && memcmp(buf + 512, data, 2 * 512) == 0);
+  CHECK(onCard(data, 400, 2));
+
+/*
+ * Staged data must survive card reinitialization.
+ */
+  CHECK(diskWrite(data + 4 * 512, 420, 2) == RES_OK);
+  CHECK(!(uosMmcDiskConf.init(&disk.base) & STA_NOINIT));
+  CHECK(onCard(data + 4 * 512, 420, 2));
+}
+
+static void testCrcErrors(void)
+{
+  sim.crcErrorBlocks = 2;
+  CHECK(diskRead(500, 8) == RES_OK && onCard(buf, 500, 8));
+
+  sim.crcErrorBlocks = 100;
+  CHECK(diskRead(600, 1) == RES_ERROR);
+
+  sim.crcErrorBlocks = 0;
+  CHECK(diskRead(600, 1) == RES_OK && onCard(buf, 600, 1));
+
+  sim.crcErrorCmd = 18;
+  CHECK(diskRead(700, 4) == RES_OK && onCard(buf, 700, 4));
+  CHECK(sim.crcErrorCmd == -1);
+
+  sim.crcErrorCmd = 13;
+  CHECK(uosMmcDiskConf.ioctl(&disk.base, MMC_GET_SDSTAT, buf) == RES_OK);
+  CHECK(sim.crcErrorCmd == -1 && buf[8] == 0x04 && buf[10] == 0x90);
+
+  sim.crcErrorCmd = 25;
+  CHECK(diskWrite(data, 800, 20) == RES_OK && diskSync() == RES_OK);
+  CHECK(sim.crcErrorCmd == -1);
+  CHECK(onCard(data, 800, 20));
+}
+
+static void testBadSector(void)
+{
+  int w;
+
+  sim.badSector = 1000;
+  CHECK(diskRead(998, 4) == RES_ERROR);
+
+  w = diskWrite(data, 998, 4);
+  CHECK(w != RES_OK || diskSync() != RES_OK);
+
+  sim.badSector = UOS_SDSIM_NONE;
+  CHECK(diskRead(0, 1) == RES_OK && onCard(buf, 0, 1));
+
+/*
+ * Reinit must not drop staged sectors that cannot be written.
+ */
+  CHECK(diskWrite(data, 1010, 2) == RES_OK);
+  sim.badSector = 1011;
+  CHECK(uosMmcDiskConf.init(&disk.base) == STA_NOINIT);
+
+  sim.badSector = UOS_SDSIM_NONE;
+  CHECK(!(uosMmcDiskConf.init(&disk.base) & STA_NOINIT));
+  CHECK(onCard(data, 1010, 2));
+}
+
+static void testRemoved(void)
+{
+  sim.removed = true;
+  CHECK(diskRead(5000, 1) != RES_OK);
+
+  sim.removed = false;
+  CHECK(!(uosMmcDiskConf.init(&disk.base) & STA_NOINIT));
+  CHECK(diskRead(5000, 1) == RES_OK && onCard(buf, 5000, 1));
+}
+
+static void testFormat(void)
+{
+  UosFile* f;
+  char text[8];
+  int n;
+
+  n = uosAddDisk(&disk.base);
+  CHECK(n >= 0);
+
+  errno = 0;
+  CHECK(uosFormatFat(UOSCFG_MAX_MOUNT, 0) == -1 && errno == ENODEV);
+
+  errno = 0;
+  CHECK(uosMountFat("/bad", UOSCFG_MAX_MOUNT) == -1 && errno == ENODEV);
+
+  CHECK(uosFormatFat(n, 0) == 0);
+  CHECK(uosMountFat("/sd", n) == 0);
+
+  f = uosFileOpen("/sd/test.txt", O_CREAT | O_WRONLY, 0);
+  CHECK(f != NULL);
+  if (f != NULL) {
+
+    CHECK(uosFileWrite(f, "format", 6) == 6);
+    CHECK(uosFileClose(f) == 0);
+  }
+
+  f = uosFileOpen("/sd/test.txt", O_RDONLY, 0);
+  CHECK(f != NULL);
+  if (f != NULL) {
+
+    CHECK(uosFileRead(f, text, sizeof(text)) == 6 && memcmp(text, "format", 6) == 0);
+    CHECK(uosFileClose(f) == 0);
+  }
+}
+
+/*
+ * Streaming format of 4 GB card. Largest clusters would leave
+ * too few clusters for FAT32 after erase block alignment.
+ */
+static void testFormatLarge(void)
+{
+  char fileName[] = "/tmp/sdsimXXXXXX";
+  char drive[3];
+  FATFS* fs;
+  DWORD clusters;
+  int fd;
+  int n;
+
+  fd = mkstemp(fileName);
+  CHECK(fd != -1);
+  if (fd == -1)
+    return;
+
+  CHECK(ftruncate(fd, (off_t)BIG_SECTORS * 512) == 0);
+  close(fd);
+
+  n = uosSdSimOpen(&bigSim, fileName);
+  unlink(fileName);
+  CHECK(n == 0);
+  if (n != 0)
+    return;
+
+  uosSpiDevInit(&bigDev, &devConf, &bigSim.bus);
+
+  bigDisk.base.cf = &uosMmcDiskConf;
+  bigDisk.cf = &mmcConf;
+  bigDisk.dev = &bigDev;
+
+  n = uosAddDisk(&bigDisk.base);
+  CHECK(n >= 0);
+
+  CHECK(uosFormatFat(n, UOS_FAT_FORMAT_STREAMING | UOS_FAT_FORMAT_SFD) == 0);
+  CHECK(uosFormatFat(n, UOS_FAT_FORMAT_STREAMING) == 0);
+  CHECK(uosMountFat("/big", n) == 0);
+
+  drive[0] = n + '0';
+  drive[1] = ':';
+  drive[2] = '\0';
+  CHECK(f_getfree(drive, &clusters, &fs) == FR_OK && fs->fs_type == FS_FAT32 && fs->csize == 64);
+}
+
+/*
+ * Flusher task writes back file that has been left dirty.
+ */
+static void testFlush(void)
+{
+  static const char text[] = "flushed by background task";
+  UosFile* f;
+
+  f = uosFileOpen("/sd/flush.txt", O_CREAT | O_WRONLY, 0);
+  CHECK(f != NULL);
+  if (f == NULL)
+    return;
+
+  CHECK(uosFileWrite(f, text, sizeof(text)) == sizeof(text));
+  CHECK(!inImage(text, sizeof(text)));
+
+  posTaskSleep(MS(UOSCFG_FAT_FLUSH_MS * 2));
+  CHECK(inImage(text, sizeof(text)));
+  CHECK(!disk.wrStream);
+
+  CHECK(uosFileClose(f) == 0);
+}
+
+static bool writeFile(const char* fileName, int len)
+{
+  UosFile* f;
+  int n;
+
+  f = uosFileOpen(fileName, O_CREAT | O_WRONLY | O_TRUNC, 0);
+  if (f == NULL)
+    return false;
+
+  while (len > 0) {
+
+    n = len < (int)sizeof(data) ? len : (int)sizeof(data);
+    if (uosFileWrite(f, (const char*)data, n) != n)
+      break;
+
+    len -= n;
+  }
+
+  return uosFileClose(f) == 0 && len == 0;
+}
+
+static DWORD freeClusters(void)
+{
+  FATFS* fs;
+  DWORD clusters;
+
+  if (f_getfree("0:", &clusters, &fs) != FR_OK)
+    return 0;
+
+  return clusters;
+}
+
+static DWORD clusterBytes(void)
+{
+  FATFS* fs;
+  DWORD clusters;
+
+  if (f_getfree("0:", &clusters, &fs) != FR_OK)
+    return 512;
+
+  return fs->csize * 512;
+}
+
+/*
+ * Clusters of removed file come back after reclaim task
+ * has run. File recreated before that must not be damaged.
+ * Format must cancel chains queued for volume.
+ */
+static void testReclaim(void)
+{
+  UosFile* f;
+  DWORD before;
+  DWORD small;
+  int i;
+
+  before = freeClusters();
+  CHECK(before > 0);
+
+  small = (sizeof(data) + clusterBytes() - 1) / clusterBytes();
+
+  CHECK(writeFile("/sd/reclaim.bin", 512 * 1024));
+  CHECK(freeClusters() < before);
+
+  CHECK(uosFileUnlink("/sd/reclaim.bin") == 0);
+  CHECK(writeFile("/sd/reclaim.bin", sizeof(data)));
+
+  for (i = 0; i < 100 && freeClusters() + small < before; i++)
+    posTaskSleep(MS(10));
+
+  CHECK(freeClusters() + small == before);
+
+  f = uosFileOpen("/sd/reclaim.bin", O_RDONLY, 0);
+  CHECK(f != NULL);
+  if (f != NULL) {
+
+    CHECK(uosFileRead(f, (char*)buf, sizeof(buf)) == sizeof(data) && memcmp(buf, data, sizeof(data)) == 0);
+    CHECK(uosFileClose(f) == 0);
+  }
+
+  CHECK(uosFileUnlink("/sd/reclaim.bin") == 0);
+
+  for (i = 0; i < 100 && freeClusters() < before; i++)
+    posTaskSleep(MS(10));
+
+  CHECK(freeClusters() == before);
+
+  CHECK(writeFile("/sd/reclaim.bin", 512 * 1024));
+  CHECK(uosFileUnlink("/sd/reclaim.bin") == 0);
+  CHECK(uosFormatFat(0, 0) == 0);
+  before = freeClusters();
+  posTaskSleep(MS(100));
+  CHECK(freeClusters() == before);
+}
+
+/*
+ * Count places where FAT chain does not continue
+ * to next cluster. Volume must be synced.
+ */
+static int chainBreaks(const FATFS* fs, DWORD clst)
+{
+  DWORD next;
+  const uint8_t* fat = image + fs->fatbase * 512;
+  int breaks = 0;
+
+  while (clst >= 2 && clst < fs->n_fatent) {
+
+    if (fs->fs_type == FS_FAT12) {
+
+      next = fat[clst + clst / 2] | (fat[clst + clst / 2 + 1] << 8);
+      next = (clst & 1) ? next >> 4 : next & 0xFFF;
+    }
+    else if (fs->fs_type == FS_FAT16)
+      next = fat[clst * 2] | (fat[clst * 2 + 1] << 8);
+    else
+      next = (fat[clst * 4] | (fat[clst * 4 + 1] << 8) | (fat[clst * 4 + 2] << 16) | ((DWORD)fat[clst * 4 + 3] << 24)) & 0x0FFFFFFF;
+
+    if (next >= 2 && next < fs->n_fatent && next != clst + 1)
+      ++breaks;
+
+    clst = next;
+  }
+
+  return breaks;
+}
+
+/*
+ * Two files growing in turns must not interleave
+ * clusters with each other.
+ */
+static void testAllocGap(void)
+{
+  FIL a, b;
+  FATFS* fs;
+  DWORD clusters;
+  UINT n;
+  int i;
+
+  CHECK(f_getfree("0:", &clusters, &fs) == FR_OK);
+
+  CHECK(f_open(&a, "0:/gapa.bin", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK);
+  CHECK(f_open(&b, "0:/gapb.bin", FA_CREATE_ALWAYS | FA_WRITE) == FR_OK);
+
+  for (i = 0; i < 32; i++) {
+
+    CHECK(f_write(&a, data, fs->csize * 512, &n) == FR_OK && n == fs->csize * 512U);
+    CHECK(f_write(&b, data, fs->csize * 512, &n) == FR_OK && n == fs->csize * 512U);
+  }
+
+  CHECK(f_close(&a) == FR_OK);
+  CHECK(f_close(&b) == FR_OK);
+
+  CHECK(chainBreaks(fs, a.sclust) <= 1);
+  CHECK(chainBreaks(fs, b.sclust) <= 1);
+
+  CHECK(f_unlink("0:/gapa.bin") == FR_OK);
+  CHECK(f_unlink("0:/gapb.bin") == FR_OK);
+}
+
+/*
+ * Loopback bus with wide frame hooks for testing
+ * default transfer functions.
+ */
+static uint8_t loopSent[256];
+static int loopLen;
+
+static void loopInit(UosSpiBus* bus)
+{
+}
+
+static void loopCS(UosSpiBus* bus, bool select)
+{
+}
+
+static uint8_t loopXchg(const UosSpiBus* bus, uint8_t data)
+{
+  if (loopLen < (int)sizeof(loopSent))
+    loopSent[loopLen++] = data;
+
+  return data;
+}
+
+static uint16_t loopXchg16(const UosSpiBus* bus, uint16_t data)
+{
+  loopXchg(bus, data >> 8);
+  loopXchg(bus, data);
+  return data;
+}
+
+static uint32_t loopXchg32(const UosSpiBus* bus, uint32_t data)
+{
+  loopXchg16(bus, data >> 16);
+  loopXchg16(bus, data);
+  return data;
+}
+
+static const UosSpiBusConf loopConf = {
+
+  .init   = loopInit,
+  .cs     = loopCS,
+  .xchg   = loopXchg,
+  .xchg16 = loopXchg16,
+  .xchg32 = loopXchg32
+};
+
+static const UosSpiDevConf loopDevConf = {
+
+  .name = "loop"
+};
+
+static UosSpiBus loopBus;
+static UosSpiDev loopDev;
+
+static bool loopCheck(const uint8_t* expect, int len)
+{
+  bool ok = loopLen == len && memcmp(loopSent, expect, len) == 0;
+
+  loopLen = 0;
+  return ok;
+}
+
+/*
+ * Default transfers use wide frames for as much as possible
+ * and accept missing tx and rx buffers.
+ */
+static void testTransfer(void)
+{
+  static const uint8_t ones[7] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+  UosSpiStats st;
+  UosSpiDev* d;
+  int i, n;
+
+  uosSpiInit(&loopBus, &loopConf);
+  uosSpiDevInit(&loopDev, &loopDevConf, &loopBus);
+  uosSpiDevInit(&loopDev, &loopDevConf, &loopBus);
+  uosSpiBegin(&loopDev);
+
+  memset(buf, 0, 7);
+  uosSpiTransfer(&loopDev, data, buf, 7);
+  CHECK(loopCheck(data, 7) && memcmp(buf, data, 7) == 0);
+
+  uosSpiXmit(&loopDev, data + 7, 7);
+  CHECK(loopCheck(data + 7, 7));
+
+  memset(buf, 0, 7);
+  uosSpiRcvr(&loopDev, buf, 7);
+  CHECK(loopCheck(ones, 7) && memcmp(buf, ones, 7) == 0);
+
+  uosSpiTransfer(&loopDev, NULL, NULL, 7);
+  CHECK(loopCheck(ones, 7));
+
+  memset(buf, 0x5a, 7);
+  uosSpiFill(&loopDev, 0x5a, 7);
+  CHECK(loopCheck(buf, 7));
+
+  uosSpiEnd(&loopDev);
+
+  uosSpiGetStats(&loopDev, &st, true);
+  CHECK(st.cycles == 1 && st.bytes == 35);
+
+  uosSpiGetStats(&loopDev, &st, false);
+  CHECK(st.cycles == 0 && st.bytes == 0);
+
+/*
+ * Device initialized twice must be listed once. It was
+ * linked last, so list can be walked from it.
+ */
+  n = 0;
+  for (d = &loopDev, i = 0; d != NULL && i < 100; d = d->next, i++)
+    if (d == &loopDev)
+      ++n;
+
+  CHECK(n == 1);
+  uosSpiDiag();
+}
+
+/*
+ * Queued transaction without buffers only clocks the bus.
+ * Transaction submitted by task that has reserved the bus
+ * must not wait for the worker.
+ */
+static void testQueue(void)
+{
+  UosSpiTransaction t = { .tx = NULL, .rx = NULL, .len = 16 };
+
+  t.done = nosSemaCreate(0, 0, "sdsimq");
+  CHECK(t.done != NULL);
+  if (t.done == NULL)
+    return;
+
+  uosSpiSubmit(&dev, &t);
+  CHECK(nosSemaWait(t.done, MS(1000)) == 0 && t.complete);
+
+  t.rx = buf;
+  buf[0] = 0;
+  uosSpiReserve(&dev, 0, 0);
+  uosSpiSubmit(&dev, &t);
+  CHECK(t.complete && buf[0] == 0xff);
+  uosSpiRelease(&dev);
+  CHECK(nosSemaWait(t.done, MS(1000)) == 0);
+
+  nosSemaDestroy(t.done);
+}
+
+/*
+ * Loopback bus with FIFO hooks. Interrupt handler is
+ * called directly while interrupt is enabled.
+ */
+static uint8_t fifoBuf[8];
+static int fifoCount;
+static int fifoFills;
+static bool fifoIrqOn;
+
+static int loopFifoFill(const UosSpiBus* bus, const uint8_t* tx, int max)
+{
+  int n;
+
+  ++fifoFills;
+  for (n = 0; n < max && fifoCount < (int)sizeof(fifoBuf); n++)
+    fifoBuf[fifoCount++] = loopXchg(bus, tx ? tx[n] : 0xff);
+
+  return n;
+}
+
+static int loopFifoDrain(const UosSpiBus* bus, uint8_t* rx, int max)
+{
+  int n = fifoCount < max ? fifoCount : max;
+
+  if (rx)
+    memcpy(rx, fifoBuf, n);
+
+  memmove(fifoBuf, fifoBuf + n, fifoCount - n);
+  fifoCount -= n;
+  return n;
+}
+
+static void loopFifoIrq(const UosSpiBus* bus, bool enable)
+{
+  if (enable && !fifoIrqOn) {
+
+    fifoIrqOn = true;
+    while (fifoIrqOn)
+      uosSpiFifoIsr((UosSpiBus*)bus);
+  }
+  else
+    fifoIrqOn = enable;
+}
+
+static const UosSpiBusConf fifoConf = {
+
+  .init      = loopInit,
+  .cs        = loopCS,
+  .xchg      = loopXchg,
+  .fifoFill  = loopFifoFill,
+  .fifoDrain = loopFifoDrain,
+  .fifoIrq   = loopFifoIrq,
+  .fifoDepth = sizeof(fifoBuf)
+};
+
+static const UosSpiDevConf fifoDevConf = {
+
+  .name = "fifo"
+};
+
+static UosSpiBus fifoBus;
+static UosSpiDev fifoDev;
+
+/*
+ * Long fill and skip go through FIFO, short ones
+ * use byte exchange.
+ */
+static void testFifo(void)
+{
+  uosSpiInit(&fifoBus, &fifoConf);
+  uosSpiDevInit(&fifoDev, &fifoDevConf, &fifoBus);
+  uosSpiBegin(&fifoDev);
+
+  loopLen = 0;
+  fifoFills = 0;
+  uosSpiFill(&fifoDev, 0x5a, 150);
+  memset(buf, 0x5a, 150);
+  CHECK(fifoFills > 0 && loopCheck(buf, 150));
+
+  fifoFills = 0;
+  uosSpiSkip(&fifoDev, 40);
+  memset(buf, 0xff, 40);
+  CHECK(fifoFills > 0 && loopCheck(buf, 40));
+
+  fifoFills = 0;
+  uosSpiFill(&fifoDev, 0x5a, 7);
+  memset(buf, 0x5a, 7);
+  CHECK(fifoFills == 0 && loopCheck(buf, 7));
+
+  uosSpiEnd(&fifoDev);
+}
+
+/*
+ * Loopback bus that counts profile changes.
+ */
+static int setClockCalls;
+static int setFormatCalls;
+
+static uint32_t profSetClock(UosSpiBus* bus, uint32_t hz)
+{
+  ++setClockCalls;
+  return hz;
+}
+
+static void profSetFormat(UosSpiBus* bus, uint8_t mode, uint8_t wordSize)
+{
+  ++setFormatCalls;
+}
+
+static const UosSpiBusConf profConf = {
+
+  .init      = loopInit,
+  .cs        = loopCS,
+  .xchg      = loopXchg,
+  .setClock  = profSetClock,
+  .setFormat = profSetFormat
+};
+
+static const UosSpiDevConf profConfA = {
+
+  .clock = 1000000,
+  .mode  = 0,
+  .name  = "profa"
+};
+
+static const UosSpiDevConf profConfB = {
+
+  .clock    = 8000000,
+  .mode     = 3,
+  .wordSize = 16,
+  .name     = "profb"
+};
+
+static UosSpiBus profBus;
+static UosSpiDev profDevA;
+static UosSpiDev profDevB;
+static UosSpiDev profDevA2;
+
+static bool profileSwitch(UosSpiDev* dev, int clockCalls, int formatCalls)
+{
+  setClockCalls = setFormatCalls = 0;
+  uosSpiBegin(dev);
+  uosSpiEnd(dev);
+  return setClockCalls == clockCalls && setFormatCalls == formatCalls;
+}
+
+/*
+ * Bus clock and format are changed only when next
+ * device has different profile than previous one.
+ */
+static void testProfile(void)
+{
+  uosSpiInit(&profBus, &profConf);
+  uosSpiDevInit(&profDevA, &profConfA, &profBus);
+  uosSpiDevInit(&profDevB, &profConfB, &profBus);
+  uosSpiDevInit(&profDevA2, &profConfA, &profBus);
+
+  CHECK(profileSwitch(&profDevA, 1, 1));
+  CHECK(profileSwitch(&profDevA, 0, 0));
+  CHECK(profileSwitch(&profDevB, 1, 1));
+  CHECK(profileSwitch(&profDevB, 0, 0));
+  CHECK(profileSwitch(&profDevA, 1, 1));
+  CHECK(profileSwitch(&profDevA2, 0, 0));
+  CHECK(profileSwitch(&profDevB, 1, 1));
+  CHECK(profileSwitch(&profDevA2, 1, 1));
+}
+
+static POSSEMA_t submitted;
+
+static void submitTask(void* arg)
+{
+  uosSpiSubmit(&loopDev, (UosSpiTransaction*)arg);
+  nosSemaSignal(submitted);
+}
+
+/*
+ * Transactions queued while bus is busy run in priority
+ * order, same priority in submit order. Worker runs at priority
+ * of highest submitting task while its transactions are queued.
+ */
+static void testQueueOrder(void)
+{
+  static const uint8_t tx[4] = { 0x10, 0x11, 0x12, 0x13 };
+  static const uint8_t prio[4] = { 0, 1, 5, 1 };
+  static const VAR_t taskPrio[4] = { 0, 2, 6, 3 };
+  static const uint8_t order[4] = { 0x10, 0x12, 0x11, 0x13 };
+  UosSpiTransaction t[4];
+  POSSEMA_t done;
+  int i;
+
+  done = nosSemaCreate(0, 0, "sdsimq");
+  submitted = nosSemaCreate(0, 0, "sdsims");
+  CHECK(done != NULL && submitted != NULL);
+  if (done == NULL || submitted == NULL)
+    return;
+
+  memset(t, '\0', sizeof(t));
+  for (i = 0; i < 4; i++) {
+
+    t[i].tx = tx + i;
+    t[i].len = 1;
+    t[i].prio = prio[i];
+    t[i].done = done;
+  }
+
+  loopLen = 0;
+  uosSpiBegin(&loopDev);
+
+/*
+ * First transaction keeps worker waiting for the bus.
+ */
+  uosSpiSubmit(&loopDev, &t[0]);
+  for (i = 0; i < 100 && loopBus.queue != NULL; i++)
+    posTaskSleep(MS(1));
+
+  CHECK(loopBus.queue == NULL);
+
+  for (i = 1; i < 4; i++) {
+
+    nosTaskCreate(submitTask, &t[i], taskPrio[i], 0, "sdsims");
+    CHECK(nosSemaWait(submitted, MS(1000)) == 0);
+  }
+
+#if POSCFG_FEATURE_GETPRIORITY == 1 && POSCFG_FEATURE_SETPRIORITY == 1
+  CHECK(posTaskGetPriority(loopBus.queueTask) == 6);
+#endif
+
+  uosSpiEnd(&loopDev);
+
+  for (i = 0; i < 4; i++)
+    CHECK(nosSemaWait(done, MS(1000)) == 0);
+
+  CHECK(loopCheck(order, 4));
+
+#if POSCFG_FEATURE_GETPRIORITY == 1 && POSCFG_FEATURE_SETPRIORITY == 1
+  for (i = 0; i < 100 && posTaskGetPriority(loopBus.queueTask) != UOSCFG_SPI_QUEUE_PRIO; i++)
+    posTaskSleep(MS(1));
+
+  CHECK(posTaskGetPriority(loopBus.queueTask) == UOSCFG_SPI_QUEUE_PRIO);
+#endif
+
+  nosSemaDestroy(submitted);
+  nosSemaDestroy(done);
+}
+
+static void testTask(void* arg)
+{
+  int i;
+
+  uosInit();
+
+  for (i = 0; i < (int)sizeof(image); i++)
+    image[i] = i * 7 + i / 512;
+
+  uosSdSimInit(&sim, image, SECTORS);
+  uosSpiDevInit(&dev, &devConf, &sim.bus);
+
+  disk.base.cf = &uosMmcDiskConf;
+  disk.cf = &mmcConf;
+  disk.dev = &dev;
+
+  testInit();
+  testReadWrite();
+  testCrcErrors();
+  testBadSector();
+  testRemoved();
+  testFormat();
+  testFormatLarge();
+  testFlush();
+  testReclaim();
+  testAllocGap();
+  testTransfer();
+  testQueue();
+  testQueueOrder();
+  testProfile();
+  testFifo();
+
+  if (failures)
+    nosPrintf("sdsim: %d checks failed\n", failures);
+  else
+    nosPrintf("sdsim: all checks passed\n");
+
+  exit(failures ? 1 : 0);
+}
+
+int main(int argc, char **argv)
+{
+  nosInit(testTask, NULL, 1, 16384, 0);
+  return 0;
+}